@@ -2,21 +2,106 @@
 
 #include "../servers/vfs.h"
 #include "../lib/queue.h"
+#include "../lib/pool.h"
 #include "../lib/mstddef.h"
 
 #include "drv.h"
 
 
 #define PD_MAX_NODES 8
+#define PD_HELD_MAX 8       /* held requests, more come from the heap */
+
+POOL_DEFINE(pd_held, vfsmsg_container_t, PD_HELD_MAX);
 
 
 
 typedef struct pdnode_s {
     char        refcnt;
     char        links;
+    char        polled;     /* the VFS waits for a change */
     q_head_t    msgs;
 } pdnode_t;
 
+#define PD_IS_READ(cmd)     (((cmd) == VFS_READC) || ((cmd) == VFS_READ))
+
+/*
+ * End of the pipe: a block read gets 0, anything else EOF
+ */
+static void
+pd_eof (vfsmsg_t* msg) {
+    msg->rw.data = (msg->cmd == VFS_READ) ? 0 : EOF;
+    msg->rw.bnum = 0;
+}
+
+/*
+ * Hand data over from a write request to a read request: one byte if
+ * either of them is a character call, as much as both blocks allow
+ * otherwise. Both answers go to rw.data, writec() gets its byte back.
+ */
+static void
+pd_transfer (vfsmsg_t* rd, vfsmsg_t* wr) {
+    int n = 1;
+    if (wr->cmd == VFS_WRITEC) {
+        if (rd->cmd == VFS_READC) {
+            rd->rw.data = wr->rw.data;
+        } else {
+            rd->rw.buf[0] = (char)wr->rw.data;
+            rd->rw.data = 1;
+        }
+        return;
+    }
+    if (rd->cmd == VFS_READC) {
+        rd->rw.data = (unsigned char)wr->rw.buf[0];
+    } else {
+        n = (rd->rw.data < wr->rw.data) ? rd->rw.data : wr->rw.data;
+        memcpy(rd->rw.buf, wr->rw.buf, n);
+        rd->rw.data = n;
+    }
+    wr->rw.data = n;
+}
+
+/*
+ * The events of a node that are ready: reading with a writer waiting,
+ * writing with a reader, both once the other end is gone
+ */
+static int
+pd_poll (pdnode_t* node, int events) {
+    vfsmsg_container_t* container = (vfsmsg_container_t*)Q_FIRST(node->msgs);
+    int ready = POLLIN | POLLOUT;
+    if ((node->refcnt > 1) || node->links) {
+        ready = !container ? 0 :
+                PD_IS_READ(container->msg.cmd) ? POLLOUT : POLLIN;
+    }
+    return (ready & events);
+}
+
+/*
+ * A request is held or an end detached, tell a polling VFS
+ */
+static void
+pd_changed (pdnode_t* node, int dev) {
+    if (node->polled) {
+        node->polled = 0;
+        vfs_rd_interrupt(dev);
+    }
+}
+
+/*
+ * A held request is done. A direct writer may complete a reader of the
+ * VFS while the VFS doesn't listen to the pipe, that answer waits in
+ * done_q until the VFS comes by with a message.
+ */
+static void
+pd_answer (vfsmsg_t* cur, q_head_t* q, q_head_t* done_q,
+           vfsmsg_container_t* container) {
+    Q_REMV(q, container);
+    if (vfs_answer(cur, &(container->msg))) {
+        POOL_FREE_OR(pd_held, container, kfree);
+    } else {
+        Q_END(done_q, container);
+    }
+}
+
 int
 pd_find_empty_node (pdnode_t** list) {
     int i;
@@ -32,19 +117,28 @@ void pipedev (void* args UNUSED) {
     pid_t               client;
     vfsmsg_t            msg;
     vfsmsg_container_t* container; /* Temporary pointer */
+    q_head_t            done_q;
+    int                 dev;
+    unsigned int        gen[PD_MAX_NODES];  /* bumped when a node is freed,
+                                             * refuses stale channels */
 
     pdnode_t** nodes = (pdnode_t**)kmalloc(sizeof(pdnode_t*) * PD_MAX_NODES);
     memset(nodes, 0, (sizeof(pdnode_t*) * PD_MAX_NODES));
+    memset(gen, 0, sizeof(gen));
+    POOL_INIT(pd_held, vfsmsg_container_t);
+    q_init(&done_q);
     kirqdis();
+    dev = vfs_getdev();
 
+    client = receive(TASK_ANY, &msg, sizeof(msg));
     while (1) {
-        client = receive(TASK_ANY, &msg, sizeof(msg));
         switch (msg.cmd) {
           case VFS_MKNOD:
             msg.mknod.ino = pd_find_empty_node(nodes);
             nodes[msg.mknod.ino] = (pdnode_t*)kmalloc(sizeof(pdnode_t));
             nodes[msg.mknod.ino]->refcnt = 0;
             nodes[msg.mknod.ino]->links = 0;
+            nodes[msg.mknod.ino]->polled = 0;
             q_init(&(nodes[msg.mknod.ino]->msgs));
             break;
 
@@ -69,6 +163,7 @@ void pipedev (void* args UNUSED) {
             }
             kfree(nodes[msg.link.ino]);
             nodes[msg.link.ino] = NULL;
+            gen[msg.link.ino]++;
             break;
 
           case VFS_INODE_GRAB:
@@ -90,13 +185,11 @@ void pipedev (void* args UNUSED) {
              * waiting tasks and empty pipe
              */
             if (nodes[msg.iget.ino]->refcnt == 1) {
+                pd_changed(nodes[msg.iget.ino], dev);
                 while (!Q_EMPTY(nodes[msg.iget.ino]->msgs)) {
                     container = (vfsmsg_container_t*) Q_FIRST(nodes[msg.iget.ino]->msgs);
-                    container->msg.rw.data = EOF;
-                    container->msg.rw.bnum = 0;
-                    container->msg.cmd = VFS_REPEAT;
-                    sendrec(client, &(container->msg), sizeof(vfsmsg_t));
-                    kfree(Q_REMV(&(nodes[msg.iget.ino]->msgs), container));
+                    pd_eof(&(container->msg));
+                    pd_answer(&msg, &(nodes[msg.iget.ino]->msgs), &done_q, container);
                 }
                 break;
             }
@@ -113,49 +206,93 @@ void pipedev (void* args UNUSED) {
 
             kfree(nodes[msg.iget.ino]);
             nodes[msg.iget.ino] = NULL;
+            gen[msg.iget.ino]++;
+            break;
+          case VFS_RD_INTERRUPT:
+            /* the VFS came for done_q */
+            msg.cmd = VFS_HOLD;
+            break;
+
+          case VFS_CHANNEL:
+            if ((msg.chan.fd >= 0) && (msg.chan.fd < PD_MAX_NODES) &&
+                nodes[msg.chan.fd]) {
+                msg.chan.ch.ino = msg.chan.fd;
+                msg.chan.ch.gen = gen[msg.chan.fd];
+            }
+            break;
+
+          case VFS_POLL:
+            if ((msg.rw.ino < 0) || (msg.rw.ino >= PD_MAX_NODES) ||
+                !nodes[msg.rw.ino]) {
+                msg.rw.data = POLLNVAL;
+            } else if (!(msg.rw.data = pd_poll(nodes[msg.rw.ino], msg.rw.data))) {
+                nodes[msg.rw.ino]->polled = 1;
+            }
             break;
+
           case VFS_WRITEC:
           case VFS_READC:
-            if (Q_EMPTY(nodes[msg.rw.ino]->msgs)) {   /* Empty pipe */
+          case VFS_WRITE:
+          case VFS_READ:
+            if ((msg.rw.ino < 0) || (msg.rw.ino >= PD_MAX_NODES) ||
+                !nodes[msg.rw.ino] || ((msg.tag == VFS_DIRECT) &&
+                                       (gen[msg.rw.ino] != msg.rw.gen))) {
+                pd_eof(&msg);       /* stale channel */
+            } else if (((msg.cmd == VFS_WRITE) || (msg.cmd == VFS_READ)) &&
+                (msg.rw.data <= 0)) {
+                msg.rw.data = 0;    /* nothing to move */
+            } else if (Q_EMPTY(nodes[msg.rw.ino]->msgs)) {   /* Empty pipe */
                 if ((nodes[msg.rw.ino]->refcnt <= 1) &&
                     (!nodes[msg.rw.ino]->links)) {
                     /* Other end detached, send EOF */
+                    pd_eof(&msg);
+                } else if (!(container = POOL_ALLOC_OR(pd_held,
+                                                       vfsmsg_container_t,
+                                                       kmalloc))) {
+                    /* Out of memory */
                     msg.rw.data = EOF;
                 } else {
                     /* FIFO empty, save request */
-                    container = (vfsmsg_container_t*) kmalloc(sizeof(vfsmsg_container_t));
                     memcpy(&(container->msg), &msg, sizeof(vfsmsg_t));
                     Q_END(&(nodes[msg.rw.ino]->msgs), container);
+                    pd_changed(nodes[msg.rw.ino], dev);
                     msg.cmd = VFS_HOLD;
                 }
             } else {        /* Read or Write requests in the pipe */
                 container = (vfsmsg_container_t*) Q_FIRST(nodes[msg.rw.ino]->msgs);
-                if (container->msg.cmd == msg.cmd) {
-                    /* Same request type, save it */
-                    container = (vfsmsg_container_t*) kmalloc(sizeof(vfsmsg_container_t));
-                    memcpy(&(container->msg), &msg, sizeof(vfsmsg_t));
-                    Q_END(&(nodes[msg.rw.ino]->msgs), container);
-                    msg.cmd = VFS_HOLD;
+                if (PD_IS_READ(container->msg.cmd) == PD_IS_READ(msg.cmd)) {
+                    /* Same direction, save it */
+                    container = POOL_ALLOC_OR(pd_held, vfsmsg_container_t, kmalloc);
+                    if (!container) {
+                        msg.rw.data = EOF;      /* Out of memory */
+                    } else {
+                        memcpy(&(container->msg), &msg, sizeof(vfsmsg_t));
+                        Q_END(&(nodes[msg.rw.ino]->msgs), container);
+                        msg.cmd = VFS_HOLD;
+                    }
                 } else {
-                    switch (container->msg.cmd) {
-                      case VFS_READC:
-                        container->msg.rw.data = msg.rw.data;
-                      break;
-                      case VFS_WRITEC:
-                        msg.rw.data = container->msg.rw.data;
-                      break;
+                    if (PD_IS_READ(msg.cmd)) {
+                        pd_transfer(&msg, &(container->msg));
+                    } else {
+                        pd_transfer(&(container->msg), &msg);
                     }
                     /* release waiting task */
-                    container->msg.cmd = VFS_REPEAT;
                     container->msg.rw.bnum = 0;
-                    sendrec(client, &(container->msg), sizeof(vfsmsg_t));
-                    kfree(Q_REMV(&(nodes[msg.rw.ino]->msgs), container));
+                    pd_answer(&msg, &(nodes[msg.rw.ino]->msgs), &done_q, container);
                 }
             }
             msg.rw.bnum = 0;
             break;
         }
-        send(client, &msg);
+        if (msg.tag != VFS_DIRECT) {
+            while ((container = (vfsmsg_container_t*)Q_FIRST(done_q))) {
+                vfs_answer(&msg, &(container->msg));
+                POOL_FREE_OR(pd_held, Q_REMV(&done_q, container), kfree);
+            }
+        } else if (!Q_EMPTY(done_q)) {
+            vfs_rd_interrupt(dev);  /* the VFS doesn't wait for the pipe */
+        }
+        client = vfs_replyrecv(client, &msg);
     }
 }
 
@@ -12,6 +12,7 @@
 
 #define MF_MAX_NODES 8
 #define MF_MAX_ENTRIES 16
+#define MF_MAX_SIZE 127     /* bytes of a file */
 
 #define MF_DIR      0x01
 
@@ -86,6 +87,7 @@ void memfile (void* args UNUSED) {
     pid_t client;
     vfsmsg_t msg;
     int ino;
+    int n;
     mfnode_t** nodes = (mfnode_t**)kmalloc(sizeof(mfnode_t*) * MF_MAX_NODES);
     memset(nodes, 0, (sizeof(mfnode_t*) * MF_MAX_NODES));
 
@@ -95,8 +97,8 @@ void memfile (void* args UNUSED) {
     mf_link(nodes[ino], ".", ino);
     nodes[ino]->links += 1;
 
+    client = receive(TASK_ANY, &msg, sizeof(msg));
     while (1) {
-        client = receive(TASK_ANY, &msg, sizeof(msg));
         switch(msg.cmd){
           case VFS_MKNOD:
             msg.mknod.ino = mf_create_node(nodes, 0);
@@ -149,7 +151,7 @@ void memfile (void* args UNUSED) {
             break;
 
           case VFS_WRITEC:
-            if (msg.rw.pos >= 127) {
+            if (msg.rw.pos >= MF_MAX_SIZE) {
                 msg.rw.data = EOF;
                 msg.rw.bnum = 0;
             } else {
@@ -161,7 +163,7 @@ void memfile (void* args UNUSED) {
             break;
 
           case VFS_READC:
-            if ((msg.rw.pos >= 127) ||
+            if ((msg.rw.pos >= MF_MAX_SIZE) ||
                 (msg.rw.pos >= nodes[msg.rw.ino]->size)) {
                 msg.rw.data = EOF;
                 msg.rw.bnum = 0;
@@ -171,6 +173,43 @@ void memfile (void* args UNUSED) {
             }
             break;
 
+          case VFS_WRITE:
+            n = MF_MAX_SIZE - msg.rw.pos;
+            if (n > msg.rw.data) {
+                n = msg.rw.data;
+            }
+            if (n <= 0) {
+                msg.rw.data = (msg.rw.data > 0) ? EOF : 0;  /* full */
+                msg.rw.bnum = 0;
+            } else {
+                memcpy(&(nodes[msg.rw.ino]->file[msg.rw.pos]), msg.rw.buf, n);
+                nodes[msg.rw.ino]->size = msg.rw.pos + n;
+                msg.rw.data = n;
+                msg.rw.bnum = n;
+            }
+            break;
+
+          case VFS_READ:
+            n = nodes[msg.rw.ino]->size - msg.rw.pos;
+            if (n > msg.rw.data) {
+                n = msg.rw.data;
+            }
+            if (n <= 0) {
+                msg.rw.data = 0;    /* end of file */
+                msg.rw.bnum = 0;
+            } else {
+                memcpy(msg.rw.buf, &(nodes[msg.rw.ino]->file[msg.rw.pos]), n);
+                msg.rw.data = n;
+                msg.rw.bnum = n;
+            }
+            break;
+
+          case VFS_POLL:
+            break;      /* always ready for what is asked */
+
+          case VFS_CHANNEL:
+            break;      /* none, the position of a file is the VFS's */
+
           case VFS_GET_DIRENTRY:
             if (nodes[msg.link.ino]->flags & MF_DIR) {
                 msg.link.ino = mf_get_direntry(nodes[msg.link.ino], msg.link.name);
@@ -179,7 +218,7 @@ void memfile (void* args UNUSED) {
             }
             break;
         }
-        send(client, &msg);
+        client = replyrecv(client, &msg, sizeof(msg));
     }
 }
 
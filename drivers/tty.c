@@ -3,17 +3,80 @@
 
 #include "../servers/vfs.h"
 #include "../lib/queue.h"
+#include "../lib/pool.h"
 #include "../lib/mstddef.h"
 
 #include "drv.h"
 
 
+/*
+ * RX ring, filled by the interrupt task and drained by the driver
+ */
+
+#define USART0_RXBUF    (16)
+
+static unsigned char    usart0_rxbuf[USART0_RXBUF];
+static unsigned char    usart0_rxhead;
+static unsigned char    usart0_rxtail;
+
+/*
+ * Cooked input: finished lines, waiting for the readers
+ */
+
+#define USART0_COOKED   (128)
+#define USART0_LINE     (128)
+
+static unsigned char    usart0_cooked[USART0_COOKED];
+static unsigned char    usart0_ckhead;
+static unsigned char    usart0_cktail;
+static char             usart0_eof;     /* Ctrl + D on an empty line */
+
+/*
+ * The transmitter is free and nothing was sent since: the token of the
+ * last WR_INTERRUPT, the next write goes out at once
+ */
+
+static char             usart0_txidle;
+
+/*
+ * Held requests, the heap takes the ones beyond the pool
+ */
+
+#define USART0_HELD_MAX (8)
+
+POOL_DEFINE(usart0_held, vfsmsg_container_t, USART0_HELD_MAX);
+
+/*
+ * Save the request and hold. Only with the heap exhausted too a client
+ * request fails with EOF, an echo of the driver is dropped.
+ */
+
+static void
+usart_hold (q_head_t* q, vfsmsg_t *msg) {
+    vfsmsg_container_t* container;
+    container = POOL_ALLOC_OR(usart0_held, vfsmsg_container_t, kmalloc);
+    if (!container) {
+        msg->rw.data = EOF;
+        msg->rw.bnum = 0;
+        msg->cmd = msg->client ? VFS_FINAL : VFS_HOLD;
+        return;
+    }
+    memcpy(&(container->msg), msg, sizeof(vfsmsg_t));
+    Q_END(q, container);
+    msg->cmd = VFS_HOLD;
+    return;
+}
+
+
 void usart0_event (void* args UNUSED) {
     pid_t       driver;
+    int         dev;
+    unsigned char c;
 
     {
         vfsmsg_t    msg;
         driver = receive(TASK_ANY, &msg, sizeof(msg));
+        dev = msg.interrupt.data;
 
         UBRR0H = 0;    /* 9600 BAUD */
         UBRR0L = 103;  /* 9600 BAUD */
@@ -37,37 +100,84 @@ void usart0_event (void* args UNUSED) {
         UCSR0B |= (1<<TXCIE0); /* Re-Enable TXC interrupt */
         switch (waitevent(EVENT_USART0RX | EVENT_USART0TX)) {
           case EVENT_USART0RX:
-            UCSR0B &= ~(1<<RXCIE0); /* Disable RXC interrupt */
-            vfs_rd_interrupt(driver);
+            c = UDR0;   /* Clear RX interrupt flag */
+            if (((usart0_rxhead + 1) % USART0_RXBUF) != usart0_rxtail) {
+                usart0_rxbuf[usart0_rxhead] = c;
+                usart0_rxhead = (usart0_rxhead + 1) % USART0_RXBUF;
+            }
+            vfs_rd_interrupt(dev);
             break;
           case EVENT_USART0TX:
             UCSR0B &= ~(1<<TXCIE0); /* Disable TXC interrupt */
             /* Executing the interrupt handler clears TXC flag automatically */
-            vfs_wr_interrupt(driver);
+            vfs_wr_interrupt(dev);
             break;
         }
     }
 }
 
+/*
+ * Sends the next byte of a write request, the transmitter is free.
+ * Returns 1 when the request is done, a block answers with its length.
+ */
+static char
+usart0_put (vfsmsg_t *msg) {
+    if (msg->cmd == VFS_WRITEC) {
+        UDR0 = (unsigned char) msg->rw.data;
+        return (1);
+    }
+    UDR0 = (unsigned char) msg->rw.buf[msg->rw.bnum++];    /* bnum: sent */
+    if (msg->rw.bnum != msg->rw.data) {
+        return (0);
+    }
+    msg->rw.bnum = 0;
+    return (1);
+}
+
+/*
+ * A write request meets the transmitter, whichever comes second is
+ * served: the request is held until its last byte is out, the free
+ * transmitter (a WR_INTERRUPT) is kept in usart0_txidle until there is
+ * something to send
+ */
 void
-usart0_serve_write(q_head_t* wr_q, vfsmsg_t *msg, int cmd_to_be_served) {
+usart0_serve_write(q_head_t* wr_q, vfsmsg_t *msg) {
     vfsmsg_container_t*   container;
 
     container = (vfsmsg_container_t*)(Q_FIRST(*wr_q));
-    if (container && container->msg.cmd == cmd_to_be_served) {
-        /* Request can be served, reply */
-        char i = (msg->cmd == VFS_WR_INTERRUPT);
-        UDR0 = (unsigned char) (i ? container->msg : *msg).rw.data;
-        msg->client = (i ? container->msg : *msg).client;
-        kfree(Q_REMV(wr_q, container));
-        msg->rw.bnum = 0;
+    if (msg->cmd == VFS_WR_INTERRUPT) {
+        if (!container) {
+            usart0_txidle = 1;
+            msg->cmd = VFS_HOLD;
+        } else if (usart0_put(&(container->msg))) {
+            if (container->msg.tag == VFS_DIRECT) {
+                /* sent by its client, it gets the answer itself */
+                vfs_answer(msg, &(container->msg));
+                msg->cmd = VFS_HOLD;
+            } else {
+                /* the answer of the request goes to its client */
+                memcpy(msg, &(container->msg), sizeof(vfsmsg_t));
+                msg->cmd = VFS_FINAL;
+            }
+            POOL_FREE_OR(usart0_held, Q_REMV(wr_q, container), kfree);
+        } else {
+            msg->cmd = VFS_HOLD;
+        }
+        return;
+    }
+    if ((msg->cmd == VFS_WRITE) && (msg->rw.data <= 0)) {
+        msg->rw.data = 0;
         msg->cmd = VFS_FINAL;
+    } else if (usart0_txidle) {
+        usart0_txidle = 0;
+        if (usart0_put(msg)) {
+            msg->rw.bnum = 0;
+            msg->cmd = VFS_FINAL;
+        } else {
+            usart_hold(wr_q, msg);
+        }
     } else {
-        /* Save the request and hold */
-        container = (vfsmsg_container_t*) kmalloc(sizeof(vfsmsg_container_t));
-        memcpy(&(container->msg), msg, sizeof(vfsmsg_t));
-        Q_END(wr_q, container);
-        msg->cmd = VFS_HOLD;
+        usart_hold(wr_q, msg);
     }
 }
 
@@ -77,61 +187,94 @@ usart0_print_char (q_head_t* wr_q, int c) {
     vfsmsg_t msg;
     msg.cmd = VFS_WRITEC;
     msg.client = NULL;
+    msg.tag = 0;
     msg.rw.data = c;
-    usart0_serve_write(wr_q, &msg, VFS_WR_INTERRUPT);
-/*
-    msg.cmd = VFS_REPEAT;
-    sendrec(client, &msg, sizeof(vfsmsg_t));
-*/
+    usart0_serve_write(wr_q, &msg);
 }
 
 /*
  * **************************
  */
 
-void
-usart_serve_read(q_head_t* rd_q, vfsmsg_t *msg, int cmd_to_be_served) {
-    vfsmsg_container_t*   container;
+static void
+usart0_cook (char c) {
+    unsigned char next = (usart0_ckhead + 1) % USART0_COOKED;
+    if (next != usart0_cktail) {
+        usart0_cooked[usart0_ckhead] = c;
+        usart0_ckhead = next;
+    }
+}
 
-    container = (vfsmsg_container_t*)(Q_FIRST(*rd_q));
-    if (container && container->msg.cmd == cmd_to_be_served) {
-        /* Request can be served, reply */
-        char i = (msg->cmd == VFS_RD_INTERRUPT);
-        msg->client = (i ? container->msg : *msg).client;
-        msg->rw.data = (i ? *msg : container->msg).interrupt.data;
-        kfree(Q_REMV(rd_q, container));
-        msg->rw.bnum = 0;
-        msg->cmd = VFS_FINAL;
+/*
+ * Answers a read request from the cooked input: READC takes a byte,
+ * READ as much as it asks for, but not past the end of a line.
+ * Returns 0 if there is nothing to read yet.
+ */
+static char
+usart_take (vfsmsg_t *msg) {
+    unsigned char c;
+    int n = 0;
+    if ((msg->cmd == VFS_READ) && (msg->rw.data <= 0)) {
+        msg->rw.data = 0;
+    } else if (usart0_cktail != usart0_ckhead) {
+        do {
+            c = usart0_cooked[usart0_cktail];
+            usart0_cktail = (usart0_cktail + 1) % USART0_COOKED;
+            if (msg->cmd == VFS_READC) {
+                n = c;
+                break;
+            }
+            msg->rw.buf[n++] = c;
+        } while ((n != msg->rw.data) && (usart0_cktail != usart0_ckhead) &&
+                 (c != '\r') && (c != '\n'));
+        msg->rw.data = n;
+    } else if (usart0_eof) {
+        usart0_eof = 0;
+        msg->rw.data = (msg->cmd == VFS_READ) ? 0 : EOF;
     } else {
-        /* Save the request and hold */
-        container = (vfsmsg_container_t*) kmalloc(sizeof(vfsmsg_container_t));
-        memcpy(&(container->msg), msg, sizeof(vfsmsg_t));
-        Q_END(rd_q, container);
-        msg->cmd = VFS_HOLD;
+        return (0);
     }
+    msg->rw.bnum = 0;
+    return (1);
 }
 
+/*
+ * New input: release the held readers while it lasts, cur is the
+ * interrupt of the VFS
+ */
+static void
+usart_serve_readers (vfsmsg_t* cur, q_head_t* rd_q) {
+    vfsmsg_container_t*   container;
+    while ((container = (vfsmsg_container_t*)(Q_FIRST(*rd_q))) &&
+           usart_take(&(container->msg))) {
+        vfs_answer(cur, &(container->msg));
+        POOL_FREE_OR(usart0_held, Q_REMV(rd_q, container), kfree);
+    }
+}
 
-void
-usart_reply_char (pid_t client, q_head_t* rd_q, int c) {
-    vfsmsg_t msg;
 
-    msg.cmd = VFS_RD_INTERRUPT;
-    msg.client = NULL;
-    msg.interrupt.data = c;
-    usart_serve_read(rd_q, &msg, VFS_READC);
-    if (msg.cmd != VFS_HOLD) {
-        msg.cmd = VFS_REPEAT;
-        sendrec(client, &msg, sizeof(vfsmsg_t));
+/*
+ * Input to read, no write waiting for the transmitter. They change with
+ * the interrupts, which the VFS sees: a poller needs no notification.
+ */
+static int
+usart_poll (q_head_t* wr_q, int events) {
+    int ready = 0;
+    if ((usart0_cktail != usart0_ckhead) || usart0_eof) {
+        ready |= POLLIN;
     }
+    if (Q_EMPTY(*wr_q)) {
+        ready |= POLLOUT;
+    }
+    return (ready & events);
 }
 
 
 void
-tty_flush (pid_t client, q_head_t* rd_q, char* buf, int* idx) {
+tty_flush (char* buf, int* idx) {
     int    i;
     for (i = 0; i != *idx; i++) {
-        usart_reply_char(client, rd_q, (int) buf[i]);
+        usart0_cook(buf[i]);
     }
     *idx = 0;
 }
@@ -149,11 +292,19 @@ void tty_usart0 (void* args UNUSED) {
     kirqdis();
     q_init(&rd_q);
     q_init(&wr_q);
+    POOL_INIT(usart0_held, vfsmsg_container_t);
 
-    tbuf = kmalloc(128);
+    tbuf = kmalloc(USART0_LINE);
     idx = 0;
+    usart0_rxhead = 0;
+    usart0_rxtail = 0;
+    usart0_ckhead = 0;
+    usart0_cktail = 0;
+    usart0_eof = 0;
+    usart0_txidle = 0;
 
     /* Setting up interrupt handler */
+    msg.interrupt.data = vfs_getdev();
     client = createtask(TASK_PRIO_RT, PAGE_INVALID);
     allocatestack(client, DEFAULT_STACK_SIZE-64);
     setuptask(client, usart0_event, NULL, NULL);
@@ -161,28 +312,37 @@ void tty_usart0 (void* args UNUSED) {
     sendrec(client, &msg, sizeof(msg));
 
 
+    client = receive(TASK_ANY, &msg, sizeof(msg));
     while (1) {
-        client = receive(TASK_ANY, &msg, sizeof(msg));
 
         switch (msg.cmd) {
           case VFS_READC:
-            usart_serve_read(&rd_q, &msg, VFS_RD_INTERRUPT);
+          case VFS_READ:
+            if (!Q_FIRST(rd_q) && usart_take(&msg)) {
+                msg.cmd = VFS_FINAL;
+            } else {
+                usart_hold(&rd_q, &msg);
+            }
             break;
           case VFS_WRITEC:
-            usart0_serve_write(&wr_q, &msg, VFS_WR_INTERRUPT);
+          case VFS_WRITE:
+            usart0_serve_write(&wr_q, &msg);
             break;
           case VFS_RD_INTERRUPT:
-            msg.interrupt.data = UDR0;  /* Clear RX interrupt flag */
-            if (!ttymode) {
-                usart_serve_read(&rd_q, &msg, VFS_READC);
-            } else {
+            while (usart0_rxtail != usart0_rxhead) {
+                msg.interrupt.data = usart0_rxbuf[usart0_rxtail];
+                usart0_rxtail = (usart0_rxtail + 1) % USART0_RXBUF;
+                if (!ttymode) {
+                    usart0_cook(msg.interrupt.data);
+                    continue;
+                }
                 switch (msg.interrupt.data) {
                   case 0x04:        /* Ctrl + D */
                     if (!idx) {
-                        usart_reply_char(client, &rd_q, EOF);
+                        usart0_eof = 1;
                     } else {
                         usart0_print_char(&wr_q, '\n');
-                        tty_flush(client, &rd_q, tbuf, &idx);
+                        tty_flush(tbuf, &idx);
                     }
                     break;
                   case 0x03:        /* Ctrl + C */
@@ -200,22 +360,30 @@ void tty_usart0 (void* args UNUSED) {
                   case '\n':        /* NewLine */
 //                    usart0_print_char(&wr_q, msg.interrupt.data);
                     tbuf[idx++] = msg.interrupt.data;
-                    tty_flush(client, &rd_q, tbuf, &idx);
+                    tty_flush(tbuf, &idx);
                     break;
                   default:
 //                    usart0_print_char(&wr_q, msg.interrupt.data);
-                    tbuf[idx++] = msg.interrupt.data;
+                    if (idx != USART0_LINE - 1) {
+                        tbuf[idx++] = msg.interrupt.data;
+                    }
                     break;
                 }
-                msg.cmd = VFS_HOLD;
             }
+            usart_serve_readers(&msg, &rd_q);
+            msg.cmd = VFS_HOLD;
             break;
           case VFS_WR_INTERRUPT:
-            usart0_serve_write(&wr_q, &msg, VFS_WRITEC);
+            usart0_serve_write(&wr_q, &msg);
+            break;
+          case VFS_POLL:
+            msg.rw.data = usart_poll(&wr_q, msg.rw.data);
+            break;
+          case VFS_CHANNEL:
+            msg.chan.ch.ino = msg.chan.fd;  /* one node, no position */
+            msg.chan.ch.gen = 0;
             break;
         }
-        send(client, &msg);
+        client = vfs_replyrecv(client, &msg);
     }
 }
-
-
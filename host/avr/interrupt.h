@@ -0,0 +1,6 @@
+#ifndef _HOST_AVR_INTERRUPT_H_
+#define _HOST_AVR_INTERRUPT_H_
+
+#include "io.h"
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef _HOST_AVR_IO_H_
+#define _HOST_AVR_IO_H_
+
+/*
+ * The ATmega1284p registers the drivers and servers touch, emulated by
+ * the timer signal handler in host/hal.c.
+ *
+ * UDR0 is wider than a byte: values below 0x100 are written by the
+ * driver and not sent yet, received bytes carry a flag above it. The
+ * driver reads and writes bytes, it doesn't notice.
+ */
+
+extern volatile unsigned char   UCSR0A;
+extern volatile unsigned char   UCSR0B;
+extern volatile unsigned char   UCSR0C;
+extern volatile unsigned char   UBRR0H;
+extern volatile unsigned char   UBRR0L;
+extern volatile unsigned int    UDR0;
+
+extern volatile unsigned int    TCNT1;
+extern volatile unsigned int    OCR1A;
+extern volatile unsigned char   TCCR1B;
+extern volatile unsigned char   TIMSK1;
+extern volatile unsigned char   TIFR1;
+
+/* UCSR0A */
+#define RXC0    7
+#define TXC0    6
+#define UDRE0   5
+
+/* UCSR0B */
+#define RXCIE0  7
+#define TXCIE0  6
+#define UDRIE0  5
+#define RXEN0   4
+#define TXEN0   3
+
+/* UCSR0C */
+#define USBS0   3
+#define UCSZ01  2
+#define UCSZ00  1
+
+/* TCCR1B */
+#define CS12    2
+#define CS11    1
+#define CS10    0
+
+/* TIMSK1, TIFR1 */
+#define OCIE1A  1
+#define TOIE1   0
+#define OCF1A   1
+#define TOV1    0
+
+#endif
@@ -0,0 +1,304 @@
+#define _XOPEN_SOURCE 600
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+
+#define pid_t kernel_pid_t          /* the OS has a pid_t of its own */
+#include "../kernel/kernel.h"
+#undef pid_t
+
+#include "avr/io.h"
+#include "hal.h"
+
+/*
+ * Linux host HAL
+ *
+ * - tasks are ucontexts, a task enters the kernel with swapcontext
+ * - SIGALRM is the only interrupt source, LOCK() blocks it
+ * - the handler emulates the peripherals the drivers touch: Timer1
+ *   counts real time at 15625 Hz, USART0 talks to a pseudo terminal
+ * - the events are raised one by one, as if each had its own ISR
+ *
+ * The OS defines open(), close(), pipe()... of its own, so the host side
+ * uses raw system calls for the pty.
+ */
+
+#define CPU_TICK_US         (250)           /* signal period */
+#define CPU_TIMER_HZ        (15625UL)       /* 16 MHz / 1024 */
+#define CPU_HEAP_SIZE       (4UL << 20)
+
+#define UDR_IDLE            (0x100)         /* transmitted, see avr/io.h */
+#define UDR_RECEIVED        (0x200)
+
+extern unsigned int     eventcode;
+void                    switchtokernel (void);
+
+long syscall (long number, ...);    /* <unistd.h> would clash with the OS */
+
+static char             cpu_heapmem[CPU_HEAP_SIZE] __attribute__ ((aligned (16)));
+static sigset_t         cpu_irqmask;        /* SIGALRM */
+static int              cpu_pty;            /* USART0 */
+static unsigned char    cpu_rx;             /* received, not in UDR0 yet */
+static unsigned long    cpu_counts;         /* Timer1 counts so far */
+static unsigned int     cpu_pending;        /* events raised, not delivered */
+static volatile sig_atomic_t cpu_busy;      /* in the middle of a switch */
+
+/* Emulated registers */
+volatile unsigned char  UCSR0A = (1 << UDRE0);
+volatile unsigned char  UCSR0B;
+volatile unsigned char  UCSR0C;
+volatile unsigned char  UBRR0H;
+volatile unsigned char  UBRR0L;
+volatile unsigned int   UDR0 = UDR_IDLE;
+volatile unsigned int   TCNT1;
+volatile unsigned int   OCR1A;
+volatile unsigned char  TCCR1B;
+volatile unsigned char  TIMSK1;
+volatile unsigned char  TIFR1;
+
+/*
+ * Peripherals
+ */
+
+static unsigned long
+cpu_now (void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((unsigned long)ts.tv_sec * CPU_TIMER_HZ +
+            (unsigned long)ts.tv_nsec / (1000000000UL / CPU_TIMER_HZ));
+}
+
+static void
+cpu_timer1 (void) {
+    unsigned long now, delta;
+    unsigned int old;
+    if (!(TCCR1B & ((1 << CS12) | (1 << CS11) | (1 << CS10)))) {
+        cpu_counts = cpu_now();     /* stopped */
+        return;
+    }
+    now = cpu_now();
+    delta = now - cpu_counts;
+    cpu_counts = now;
+    if (!delta) {
+        return;
+    }
+    old = TCNT1 & 0xFFFF;
+    TCNT1 = (old + delta) & 0xFFFF;
+    if ((TIMSK1 & (1 << OCIE1A)) &&
+        (((OCR1A - old - 1) & 0xFFFF) < delta)) {
+        cpu_pending |= EVENT_TIMER1COMPA;
+    }
+    if (old + delta > 0xFFFF) {
+        TIFR1 |= (1 << TOV1);
+        if (TIMSK1 & (1 << TOIE1)) {
+            cpu_pending |= EVENT_TIMER1OVF;
+        }
+    }
+}
+
+static void
+cpu_usart0 (void) {
+    unsigned char c;
+    if ((UCSR0B & (1 << TXEN0)) && UDR0 < UDR_IDLE) {
+        c = (unsigned char)UDR0;
+        syscall(SYS_write, cpu_pty, &c, 1);
+        UDR0 = UDR_IDLE;
+        UCSR0A |= (1 << TXC0);
+    }
+    if ((UCSR0B & (1 << RXEN0)) && !(UCSR0A & (1 << RXC0)) &&
+        syscall(SYS_read, cpu_pty, &c, 1) == 1) {
+        cpu_rx = c;
+        UCSR0A |= (1 << RXC0);
+    }
+    /* the flags are cleared as the interrupt is taken */
+    if ((UCSR0A & (1 << TXC0)) && (UCSR0B & (1 << TXCIE0))) {
+        UCSR0A &= ~(1 << TXC0);
+        cpu_pending |= EVENT_USART0TX;
+    }
+    /* RX and TX share UDR0 here, a byte the driver has written but the
+     * line hasn't taken yet holds the received one back */
+    if ((UCSR0A & (1 << RXC0)) && (UCSR0B & (1 << RXCIE0)) &&
+        UDR0 >= UDR_IDLE) {
+        UDR0 = UDR_RECEIVED | cpu_rx;
+        UCSR0A &= ~(1 << RXC0);
+        cpu_pending |= EVENT_USART0RX;
+    }
+}
+
+/*
+ * Interrupts
+ */
+
+static void
+cpu_tick (int sig UNUSED) {
+    unsigned int ev;
+    cpu_timer1();
+    cpu_usart0();
+    if (cpu_busy) {
+        return;     /* the next tick delivers them */
+    }
+    while (cpu_pending) {
+        ev = cpu_pending & -cpu_pending;    /* lowest bit first */
+        cpu_pending &= ~ev;
+        if (ev == EVENT_TIMER1OVF) {
+            TIFR1 &= ~(1 << TOV1);          /* cleared by the ISR call */
+        }
+        eventcode = ev;
+        switchtokernel();
+    }
+}
+
+static void cpu_init (void) __attribute__ ((constructor));
+
+static void
+cpu_init (void) {
+    struct sigaction sa;
+    struct itimerval it;
+    struct termios tio;
+
+    sigemptyset(&cpu_irqmask);
+    sigaddset(&cpu_irqmask, SIGALRM);
+    sigprocmask(SIG_BLOCK, &cpu_irqmask, NULL);
+
+    cpu_pty = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (cpu_pty < 0 || grantpt(cpu_pty) || unlockpt(cpu_pty)) {
+        perror("USART0 pty");
+        exit(1);
+    }
+    /* a raw line, as the wire of the real port */
+    tcgetattr(cpu_pty, &tio);
+    tio.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR |
+                     ICRNL | IXON);
+    tio.c_oflag &= ~OPOST;
+    tio.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+    tcsetattr(cpu_pty, TCSANOW, &tio);
+    fprintf(stderr, "USART0 on %s\n", ptsname(cpu_pty));
+
+    sa.sa_handler = cpu_tick;
+    sa.sa_flags = SA_RESTART;
+    sigfillset(&sa.sa_mask);
+    sigaction(SIGALRM, &sa, NULL);
+
+    it.it_interval.tv_sec = 0;
+    it.it_interval.tv_usec = CPU_TICK_US;
+    it.it_value = it.it_interval;
+    setitimer(ITIMER_REAL, &it, NULL);
+    cpu_counts = cpu_now();
+}
+
+/*
+ *
+ */
+
+void
+cpu_irqdis (void) {
+    sigprocmask(SIG_BLOCK, &cpu_irqmask, NULL);
+}
+
+void
+cpu_irqen (void) {
+    sigprocmask(SIG_UNBLOCK, &cpu_irqmask, NULL);
+}
+
+unsigned char
+cpu_irqsave (void) {
+    sigset_t old;
+    sigprocmask(SIG_BLOCK, &cpu_irqmask, &old);
+    return (!sigismember(&old, SIGALRM));
+}
+
+void
+cpu_irqrestore (unsigned char enabled) {
+    if (enabled) {
+        cpu_irqen();
+    }
+}
+
+unsigned int
+cpu_clock (void) {
+    return (TCNT1 & 0xFFFF);
+}
+
+void
+cpu_sleep (void) {
+    sigset_t none;
+    sigemptyset(&none);
+    sigsuspend(&none);
+}
+
+void*
+cpu_heap (size_t margin UNUSED, size_t* size) {
+    *size = sizeof(cpu_heapmem);
+    return (cpu_heapmem);
+}
+
+/*
+ * Tasks
+ * makecontext() passes int arguments only, the context pointer travels
+ * in two halves. The high one is 0 where pointers have 32 bits.
+ */
+
+#if UINTPTR_MAX > 0xFFFFFFFFUL
+#define CPU_PTRHI(p)        ((unsigned int)((uintptr_t)(p) >> 32))
+#define CPU_PTR(hi, lo)     (((uintptr_t)(hi) << 32) | (uintptr_t)(lo))
+#else
+#define CPU_PTRHI(p)        (0U)
+#define CPU_PTR(hi, lo)     ((uintptr_t)(lo))
+#endif
+#define CPU_PTRLO(p)        ((unsigned int)((uintptr_t)(p) & 0xFFFFFFFFUL))
+
+static void
+cpu_taskentry (unsigned int hi, unsigned int lo) {
+    cpu_context_t* ctxt = (cpu_context_t*)CPU_PTR(hi, lo);
+    int code;
+    cpu_busy = 0;
+    /* The same return chain as the frame built on the AVR, where the
+     * exit function finds the program's return value in r24:25 */
+    code = ((int (*)(void*))ctxt->entry)((void*)ctxt->p[0]);
+    if (ctxt->exitfn) {
+        ((void (*)(int))ctxt->exitfn)(code);
+    }
+    ctxt->exittask();
+}
+
+void
+cpu_setupframe (cpu_context_t* ctxt, char* stack, size_t size,
+                void (*tp)(void* args), void* args,
+                void (*exitfn)(void), void (*exittask)(void)) {
+    getcontext(&ctxt->uc);
+    ctxt->uc.uc_stack.ss_sp = stack;
+    ctxt->uc.uc_stack.ss_size = size;
+    ctxt->uc.uc_link = NULL;
+    ctxt->entry = tp;
+    ctxt->p[0] = (uintptr_t)args;
+    ctxt->exitfn = exitfn;
+    ctxt->exittask = exittask;
+    makecontext(&ctxt->uc, (void (*)(void))cpu_taskentry, 2,
+                CPU_PTRHI(ctxt), CPU_PTRLO(ctxt));
+}
+
+void
+cpu_setirq (cpu_context_t* ctxt, int enable) {
+    if (enable) {
+        sigdelset(&ctxt->uc.uc_sigmask, SIGALRM);
+    } else {
+        sigaddset(&ctxt->uc.uc_sigmask, SIGALRM);
+    }
+}
+
+/*
+ * swapcontext() restores the signal mask before the registers, a tick
+ * in between would find the kernel stack with the task's context
+ * half loaded. The handler leaves such ticks pending.
+ */
+void
+cpu_switch (cpu_context_t* from, cpu_context_t* to) {
+    cpu_busy = 1;
+    swapcontext(&from->uc, &to->uc);
+    cpu_busy = 0;
+}
@@ -0,0 +1,81 @@
+#ifndef _HOST_HAL_H_
+#define _HOST_HAL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <ucontext.h>
+#include "../lib/commondef.h"
+
+/*
+ * HAL of the Linux host build: tasks are ucontexts on their kernel
+ * allocated stacks, the timer signal plays the interrupts, see hal.c
+ */
+
+void cpu_sleep (void);
+
+unsigned int cpu_clock (void);
+void* cpu_heap (size_t margin, size_t* size);
+
+void cpu_irqdis (void);
+void cpu_irqen (void);
+
+
+/*
+ * Task context, at the top of the task's stack like the AVR frames.
+ * The kernel call parameters and the short message live here instead
+ * of in registers.
+ */
+
+typedef struct cpu_context_s {
+    ucontext_t      uc;
+    unsigned char   code;           /* kernel call code */
+    uintptr_t       p[4];           /* parameters, p[0] is the result */
+    uintptr_t       peer;           /* short message peer */
+    unsigned char   smsg[4 * sizeof(void*)];   /* short message payload */
+    void            (*entry) (void* args);
+    void            (*exitfn) (void);
+    void            (*exittask) (void);
+} cpu_context_t;
+
+typedef cpu_context_t   cpu_trapframe_t;
+typedef cpu_context_t   cpu_irqframe_t;
+
+void cpu_setupframe (cpu_context_t* ctxt, char* stack, size_t size,
+                     void (*tp)(void* args), void* args,
+                     void (*exitfn)(void), void (*exittask)(void));
+
+/* Resume a trapped task with interrupts enabled or disabled */
+void cpu_setirq (cpu_context_t* ctxt, int enable);
+
+void cpu_switch (cpu_context_t* from, cpu_context_t* to);
+
+
+#define LOCK()      cpu_irqdis()
+
+#define UNLOCK()    cpu_irqen()
+
+
+#define GETP0(ctxt)         ((ctxt)->p[0])
+#define SETP0(ctxt, v)      ((ctxt)->p[0] = (uintptr_t)(v))
+#define GETP1(ctxt)         ((ctxt)->p[1])
+#define SETP1(ctxt, v)      ((ctxt)->p[1] = (uintptr_t)(v))
+#define GETP2(ctxt)         ((ctxt)->p[2])
+#define SETP2(ctxt, v)      ((ctxt)->p[2] = (uintptr_t)(v))
+#define GETP3(ctxt)         ((ctxt)->p[3])
+#define SETP3(ctxt, v)      ((ctxt)->p[3] = (uintptr_t)(v))
+
+#define GETPEER(ctxt)       ((ctxt)->peer)
+#define SETPEER(ctxt, v)    ((ctxt)->peer = (uintptr_t)(v))
+
+#define SMSG(ctxt)          ((void*)((ctxt)->smsg))
+#define SMSG_SIZE           (sizeof(smsg_t))
+
+#define GET_CTXT(task)      ((cpu_context_t*)(((task)->sp) + 1))
+
+/* glibc and the signal frames need far more than the AVR */
+#define CPU_STACK(size)     ((size) * 32 + 16384)
+
+#define SET_KCALLCODE(ctxt, c)  ((ctxt)->code = (c))
+#define GET_KCALLCODE(ctxt)     ((ctxt)->code)
+
+#endif
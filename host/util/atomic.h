@@ -0,0 +1,18 @@
+#ifndef _HOST_UTIL_ATOMIC_H_
+#define _HOST_UTIL_ATOMIC_H_
+
+/*
+ * ATOMIC_BLOCK of avr-libc on the host: the timer signal is blocked in
+ * the block and the previous state comes back at its end
+ */
+
+unsigned char cpu_irqsave (void);
+void cpu_irqrestore (unsigned char enabled);
+
+#define ATOMIC_RESTORESTATE     (0)
+
+#define ATOMIC_BLOCK(type)                                              \
+    for (unsigned char cpu_irq_ = cpu_irqsave(), cpu_once_ = 1;         \
+         cpu_once_; cpu_irqrestore(cpu_irq_), cpu_once_ = 0)
+
+#endif
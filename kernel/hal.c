@@ -153,9 +153,11 @@ void restore_context (void) {
 
 /**
  * software trap
+ * eventcode is always EVENT_NONE while a task runs, no need to set it
  */
 void swtrap (void) {
-    SWITCH_TO_KERNEL(EVENT_NONE);
+    LOCK();
+    asm("\n\tjmp traptokernel\n\t"::);
 }
 
 
@@ -167,6 +169,14 @@ ISR (TIMER1_OVF_vect) { /* GIE cleared automatically */
     SWITCH_TO_KERNEL(EVENT_TIMER1OVF);
 }
 
+/**
+ * timer1 compare match A interrupt handler
+ */
+ISR (TIMER1_COMPA_vect) __attribute__ ((signal, naked));
+ISR (TIMER1_COMPA_vect) { /* GIE cleared automatically */
+    SWITCH_TO_KERNEL(EVENT_TIMER1COMPA);
+}
+
 /**
  * USART0 RX COMPLETE interrupt handler
  */
@@ -203,6 +213,23 @@ ISR (USART1_TX_vect) { /* GIE cleared automatically */
  *
  */
 
+unsigned int
+cpu_clock (void) {
+    return (TCNT1);
+}
+
+/*
+ * Free RAM between the end of .bss and the stack of the caller,
+ * leaving margin bytes for the stack to grow
+ */
+void*
+cpu_heap (size_t margin, size_t* size) {
+    extern char __heap_start;
+    char* top = (char*)GET_SP() - margin;
+    *size = (top > &__heap_start) ? (size_t)(top - &__heap_start) : 0;
+    return (&__heap_start);
+}
+
 void
 cpu_sleep (void) {
     /* IDLE mode */
@@ -1,6 +1,10 @@
 #ifndef _HAL_H_
 #define _HAL_H_
 
+#ifdef HOST
+#include "../host/hal.h"    /* the kernel as a Linux process */
+#else
+
 #include "../lib/commondef.h"
 
 
@@ -9,11 +13,21 @@ void swtrap (void ) __attribute__ ((naked));
 
 void cpu_sleep (void);
 
+unsigned int cpu_clock (void);
+void* cpu_heap (size_t margin, size_t* size);
 
-typedef struct cpu_context_s {
 
-    unsigned char   r0;
-    unsigned char   r1;
+/*
+ * Task register frame. Its first part, r2..r29, is common to both kinds
+ * of frames, so the kernel reaches the parameter registers the same way
+ * whatever way the task entered the kernel.
+ *
+ * - kernel calls (swtrap) are ordinary function calls, so r0, r1, r30, r31
+ *   and SREG are clobbered or fixed by the ABI and left out of the frame
+ * - interrupts may come anywhere, the whole register file is saved
+ */
+
+typedef struct cpu_context_s {
     unsigned char   r2;
     unsigned char   r3;
     unsigned char   r4;
@@ -42,25 +56,28 @@ typedef struct cpu_context_s {
     unsigned char   r27;
     unsigned char   r28;
     unsigned char   r29;
+} cpu_context_t;
+
+typedef struct cpu_trapframe_s {
+    cpu_context_t   regs;
+    unsigned char   retHigh;
+    unsigned char   retLow;
+} cpu_trapframe_t;
+
+typedef struct cpu_irqframe_s {
+    cpu_context_t   regs;
+    unsigned char   r0;
+    unsigned char   r1;
     unsigned char   r30;
     unsigned char   rSREG;
     unsigned char   r31;
-
-//    unsigned char   call_code;
-//    unsigned char   evnt_code;
-
     unsigned char   retHigh;
     unsigned char   retLow;
-} cpu_context_t;
+} cpu_irqframe_t;
 
 
-
-#define SAVE_CONTEXT()                          \
+#define SAVE_REGS()                             \
     asm volatile (  "\n\t                   "   \
-                    "push r31           \n\t"   \
-                    "in r31, __SREG__   \n\t"   \
-                    "push r31           \n\t"   \
-                    "push r30           \n\t"   \
                     "push r29           \n\t"   \
                     "push r28           \n\t"   \
                     "push r27           \n\t"   \
@@ -89,15 +106,10 @@ typedef struct cpu_context_s {
                     "push r4            \n\t"   \
                     "push r3            \n\t"   \
                     "push r2            \n\t"   \
-                    "push r1            \n\t"   \
-                    "push r0            \n\t"   \
     );
 
-
-#define RESTORE_CONTEXT()                       \
+#define RESTORE_REGS()                          \
     asm volatile (  "\n\t                   "   \
-                    "pop r0             \n\t"   \
-                    "pop r1             \n\t"   \
                     "pop r2             \n\t"   \
                     "pop r3             \n\t"   \
                     "pop r4             \n\t"   \
@@ -126,12 +138,95 @@ typedef struct cpu_context_s {
                     "pop r27            \n\t"   \
                     "pop r28            \n\t"   \
                     "pop r29            \n\t"   \
+    );
+
+
+/*
+ * Full frame, for interrupts
+ */
+
+#define SAVE_CONTEXT()                          \
+    asm volatile (  "\n\t                   "   \
+                    "push r31           \n\t"   \
+                    "in r31, __SREG__   \n\t"   \
+                    "push r31           \n\t"   \
+                    "push r30           \n\t"   \
+                    "push r1            \n\t"   \
+                    "push r0            \n\t"   \
+                    "clr r1             \n\t"   \
+    );                                          \
+    SAVE_REGS()
+
+#define RESTORE_CONTEXT()                       \
+    RESTORE_REGS()                              \
+    asm volatile (  "\n\t                   "   \
+                    "pop r0             \n\t"   \
+                    "pop r1             \n\t"   \
                     "pop r30            \n\t"   \
                     "pop r31            \n\t"   \
                     "out __SREG__, r31  \n\t"   \
                     "pop r31            \n\t"   \
     );
 
+
+/*
+ * Light frame, for kernel calls
+ */
+
+#define SAVE_TRAP_CONTEXT()     SAVE_REGS()
+
+#define RESTORE_TRAP_CONTEXT()  RESTORE_REGS()
+
+
+/*
+ * The kernel only leaves through a call of switch_from_kernel(), the
+ * callee-saved registers are enough. r1 is zero on both sides.
+ */
+
+#define SAVE_KERNEL_CONTEXT()                   \
+    asm volatile (  "\n\t                   "   \
+                    "push r29           \n\t"   \
+                    "push r28           \n\t"   \
+                    "push r17           \n\t"   \
+                    "push r16           \n\t"   \
+                    "push r15           \n\t"   \
+                    "push r14           \n\t"   \
+                    "push r13           \n\t"   \
+                    "push r12           \n\t"   \
+                    "push r11           \n\t"   \
+                    "push r10           \n\t"   \
+                    "push r9            \n\t"   \
+                    "push r8            \n\t"   \
+                    "push r7            \n\t"   \
+                    "push r6            \n\t"   \
+                    "push r5            \n\t"   \
+                    "push r4            \n\t"   \
+                    "push r3            \n\t"   \
+                    "push r2            \n\t"   \
+    );
+
+#define RESTORE_KERNEL_CONTEXT()                \
+    asm volatile (  "\n\t                   "   \
+                    "pop r2             \n\t"   \
+                    "pop r3             \n\t"   \
+                    "pop r4             \n\t"   \
+                    "pop r5             \n\t"   \
+                    "pop r6             \n\t"   \
+                    "pop r7             \n\t"   \
+                    "pop r8             \n\t"   \
+                    "pop r9             \n\t"   \
+                    "pop r10            \n\t"   \
+                    "pop r11            \n\t"   \
+                    "pop r12            \n\t"   \
+                    "pop r13            \n\t"   \
+                    "pop r14            \n\t"   \
+                    "pop r15            \n\t"   \
+                    "pop r16            \n\t"   \
+                    "pop r17            \n\t"   \
+                    "pop r28            \n\t"   \
+                    "pop r29            \n\t"   \
+    );
+
 /*
  *
  */
@@ -203,8 +298,29 @@ typedef struct cpu_context_s {
 
 
 
+/*
+ * Short message: 8 bytes of payload in r18..r25, peer pid in r26:r27
+ */
+
+#define GETPEER(ctxt)                                                   \
+    ((((unsigned int)(ctxt)->r27) << 8) | (unsigned int)(ctxt)->r26)    \
+
+#define SETPEER(ctxt, v)                                                \
+    do {                                                                \
+        unsigned int v_cp = (unsigned int) (v);                         \
+        (ctxt)->r27 = HIGH(v_cp);                                       \
+        (ctxt)->r26 = LOW(v_cp);                                        \
+    } while (0)                                                         \
+
+#define SMSG(ctxt)      ((void*)&((ctxt)->r18))
+#define SMSG_SIZE       (8)
+
+
 #define GET_CTXT(task) (cpu_context_t*)(((task)->sp) + 1)
 
+/* Stack bytes a task needs for size bytes of its own stack */
+#define CPU_STACK(size)     (size)
+
 #define KERNEL_CALL(c)                                                  \
     do {                                                                \
         asm volatile("push  r16\n\t"::);                                \
@@ -213,8 +329,22 @@ typedef struct cpu_context_s {
         asm volatile("pop  r16\n\t"::);                                 \
     } while (0)
 
+/*
+ * Kernel call with the operands bound to registers, for calls that
+ * carry data both ways in r18..r27
+ */
+#define KERNEL_CALL_SHORT(c, peer, w0, w1, w2, w3)                      \
+    asm volatile("push  r16\n\t"                                        \
+                 "ldi  r16, " STRINGIFY(c) "\n\t"                       \
+                 "call swtrap\n\t"                                      \
+                 "pop  r16\n\t"                                         \
+                 : "+r" (peer), "+r" (w0), "+r" (w1), "+r" (w2), "+r" (w3) \
+                 :                                                      \
+                 : "r30", "r31", "memory")
+
 #define SET_KCALLCODE(ctxt, c)     (ctxt)->r16 = (c)
 #define GET_KCALLCODE(ctxt)     ((ctxt)->r16)
 
+#endif /* HOST */
 
 #endif
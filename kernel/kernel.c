@@ -1,6 +1,8 @@
 #include <avr/interrupt.h>
 #include <string.h>
 #include "../lib/queue.h"
+#include "../lib/pool.h"
+#include "../lib/heap.h"
 #include "hal.h"
 #include "kernel.h"
 
@@ -9,12 +11,32 @@
  * kernel globals
  */
 
+#ifndef HOST
 static char*                kernel_sp;      /* Kernel SP */
+#else
+static cpu_context_t        kernel_ctxt;    /* Kernel context */
+#endif
 
 static q_head_t             queue[TASK_PRIO_QUEUE_MAX];
 static q_head_t             current_q;
 static q_head_t             blocked_q;
 
+static struct task_s*       eventwaiter[EVENT_SLOTS];
+
+static struct task_s*       tasklist;       /* every task, for taskstat */
+
+#define KERNEL_STACK_MARGIN (256)   /* kernel stack below kernel() */
+
+static heap_t               kheap;          /* stacks and kmalloc */
+
+#ifdef KTRACE
+#define KTRACE_SIZE         (32)    /* records, power of 2 */
+
+static ktrace_t             ktrace_ring[KTRACE_SIZE];
+static unsigned char        ktrace_head;    /* oldest record */
+static unsigned char        ktrace_count;
+#endif
+
 unsigned int                eventcode;     /* kernel event code */
 
 #define CURRENT         ((task_t*)(Q_FIRST(current_q)))
@@ -23,18 +45,35 @@ unsigned int                eventcode;     /* kernel event code */
  * TASK
  */
 
-typedef struct task_s {     /* 11 bytes */
+typedef struct task_s {     /* 40 bytes */
     QUEUE_HEADER            /* 4 byte */
     char*           sp;            /* stack pointer */
     char*           sb;            /* stack bottom */
-    unsigned char   prio;          /* task priority */
+    size_t          ss;            /* stack size */
+    unsigned char   prio;          /* task priority (inherited) */
+    unsigned char   baseprio;      /* task priority (own) */
     unsigned char   flags;         /* task flags */
     char            page;          /* page (-1 = invalid) */
+    q_head_t        sender_q;      /* senders blocked on this task */
+    struct task_s*  sendto;        /* blocked sending to this task */
+    struct task_s*  rcvfrom;       /* blocked receiving from this task */
+    unsigned int    pending;       /* pending notification bits */
+    struct task_s*  nexttask;      /* next in tasklist */
+    void*           data;          /* user level word, see taskdata() */
+    unsigned long   ticks;         /* statistics, see taskstat_t */
+    unsigned int    kcalls;
+    unsigned int    sent;
+    unsigned int    received;
+    unsigned int    preempted;
 } task_t;
 
 
+POOL_DEFINE(task_pool, task_t, TASK_MAX);
+
+
 #define TASK_FLAG_IRQDIS        (0x01)
 #define TASK_FLAG_USE_PAGES     (0x02)
+#define TASK_FLAG_TRAPFRAME     (0x04)  /* light frame on the stack */
 
 /*
  * kernel call codes
@@ -42,6 +81,11 @@ typedef struct task_s {     /* 11 bytes */
 
 #define KCALL_YIELD             0x00
 #define KCALL_GETPID            0x01
+#define KCALL_TASKSTAT          0x02
+#define KCALL_STACKPEAK         0x03
+#define KCALL_KTRACE            0x05
+#define KCALL_TASKDATA          0x06
+#define KCALL_SETTASKDATA       0x07
 
 #define KCALL_IRQEN             0x10
 #define KCALL_IRQDIS            0x11
@@ -60,6 +104,19 @@ typedef struct task_s {     /* 11 bytes */
 #define KCALL_SEND              0x40
 #define KCALL_SENDREC           0x41
 #define KCALL_RECEIVE           0x42
+#define KCALL_REPLYRECV         0x43
+
+#define KCALL_SHORT             0x04    /* msg carried in registers */
+#define KCALL_SENDS             (KCALL_SEND | KCALL_SHORT)
+#define KCALL_SENDRECS          (KCALL_SENDREC | KCALL_SHORT)
+#define KCALL_RECEIVES          (KCALL_RECEIVE | KCALL_SHORT)
+#define KCALL_REPLYRECVS        (KCALL_REPLYRECV | KCALL_SHORT)
+
+#define GET_IPCCODE(ctxt)       (GET_KCALLCODE(ctxt) & ~(KCALL_SHORT))
+#define IS_SHORT(ctxt)          (GET_KCALLCODE(ctxt) & (KCALL_SHORT))
+
+#define KCALL_NOTIFY            0x48
+#define KCALL_GETNOTIFY         0x49
 
 #define KCALL_WAITEVENT         0x50
 
@@ -68,23 +125,46 @@ typedef struct task_s {     /* 11 bytes */
  *
  */
 
+#ifndef HOST
+
 void switchtokernel (void) __attribute__ ((naked));
+void traptokernel (void) __attribute__ ((naked));
 void switch_from_kernel (void) __attribute__ ((naked));
 
 
 void switchtokernel (void) {
     SAVE_CONTEXT();
     CURRENT->sp = GET_SP();
+    CURRENT->flags &= ~(TASK_FLAG_TRAPFRAME);
     SET_SP(kernel_sp);
-    RESTORE_CONTEXT();
+    RESTORE_KERNEL_CONTEXT();
+    RETURN();
+}
+
+
+void traptokernel (void) {
+    SAVE_TRAP_CONTEXT();
+    CURRENT->sp = GET_SP();
+    CURRENT->flags |= (TASK_FLAG_TRAPFRAME);
+    SET_SP(kernel_sp);
+    RESTORE_KERNEL_CONTEXT();
     RETURN();
 }
 
 
 void switch_from_kernel (void) {
-    SAVE_CONTEXT();
+    SAVE_KERNEL_CONTEXT();
     kernel_sp = GET_SP();
     SET_SP(CURRENT->sp);
+    if (CURRENT->flags & TASK_FLAG_TRAPFRAME) {
+        if (CURRENT->flags & TASK_FLAG_IRQDIS) {
+            RESTORE_TRAP_CONTEXT();
+            RETURN();
+        } else {
+            RESTORE_TRAP_CONTEXT();
+            RETI();
+        }
+    }
     if (CURRENT->flags & TASK_FLAG_IRQDIS) {
         /* Don't turn on interrupts  */
         RESTORE_CONTEXT();
@@ -96,6 +176,32 @@ void switch_from_kernel (void) {
     }
 }
 
+#else /* HOST */
+
+/* Called by the timer signal handler, see host/hal.c */
+void switchtokernel (void) {
+    CURRENT->flags &= ~(TASK_FLAG_TRAPFRAME);
+    cpu_switch(GET_CTXT(CURRENT), &kernel_ctxt);
+}
+
+
+void traptokernel (void) {
+    CURRENT->flags |= (TASK_FLAG_TRAPFRAME);
+    cpu_switch(GET_CTXT(CURRENT), &kernel_ctxt);
+}
+
+
+void switch_from_kernel (void) {
+    /* an interrupted task returns from the signal handler, which
+     * restores its signal mask */
+    if (CURRENT->flags & TASK_FLAG_TRAPFRAME) {
+        cpu_setirq(GET_CTXT(CURRENT), !(CURRENT->flags & TASK_FLAG_IRQDIS));
+    }
+    cpu_switch(&kernel_ctxt, GET_CTXT(CURRENT));
+}
+
+#endif /* HOST */
+
 
 /*
  *
@@ -109,9 +215,60 @@ init_task_queues (void) {
     }
     q_init(&current_q);
     q_init(&blocked_q);
+    memset(eventwaiter, 0, sizeof(eventwaiter));
+    POOL_INIT(task_pool, task_t);
     return;
 };
 
+/*
+ * Kernel trace: the ring keeps the latest KTRACE_SIZE records
+ */
+
+#ifdef KTRACE
+
+static void
+ktrace_put (unsigned char type, unsigned char code, task_t* task, task_t* peer) {
+    ktrace_t* rec;
+    if (ktrace_count == KTRACE_SIZE) {
+        /* full, overwrite the oldest */
+        ktrace_head = (ktrace_head + 1) & (KTRACE_SIZE - 1);
+        ktrace_count--;
+    }
+    rec = &ktrace_ring[(ktrace_head + ktrace_count) & (KTRACE_SIZE - 1)];
+    ktrace_count++;
+    rec->time = cpu_clock();
+    rec->type = type;
+    rec->code = code;
+    rec->task = task;
+    rec->peer = peer;
+    return;
+}
+
+#define KTRACE_PUT(type, code, task, peer) \
+    ktrace_put((type), (code), (task), (peer))
+
+#else
+
+#define KTRACE_PUT(type, code, task, peer)
+
+#endif
+
+static int
+do_ktrace (ktrace_t* buf, int n) {
+    int i = 0;
+#ifdef KTRACE
+    for (; (i < n) && ktrace_count; i++) {
+        memcpy(&buf[i], &ktrace_ring[ktrace_head], sizeof(ktrace_t));
+        ktrace_head = (ktrace_head + 1) & (KTRACE_SIZE - 1);
+        ktrace_count--;
+    }
+#else
+    (void)buf;
+    (void)n;
+#endif
+    return (i);
+}
+
 /*
  * Allocate memory for new task
  */
@@ -119,13 +276,33 @@ init_task_queues (void) {
 static task_t*
 newtask (void) {
     task_t* ptsk;
-    ptsk = (task_t*) malloc(sizeof(task_t));
+    ptsk = POOL_ALLOC(task_pool, task_t);
     if (ptsk) {
         memset(ptsk, 0, sizeof(task_t));
+        q_init(&(ptsk->sender_q));
+        ptsk->nexttask = tasklist;
+        tasklist = ptsk;
     }
     return (ptsk);
 }
 
+/*
+ * Free a task that is already off its queue
+ */
+
+static void
+freetask (task_t* task) {
+    task_t** it;
+    for (it = &tasklist; *it; it = &((*it)->nexttask)) {
+        if (*it == task) {
+            *it = task->nexttask;
+            break;
+        }
+    }
+    POOL_FREE(task_pool, task);
+    return;
+}
+
 /*
  * idle task
  * This task runs 99.9% of the time, so it shoud really not do anything
@@ -139,28 +316,83 @@ idle_task (void* args UNUSED) {
 }
 
 
+#ifndef HOST
 static void
 do_pushstack (task_t* task, char val) {
     *(task->sp) = val;
     task->sp -= 1;
 }
+#endif
+
+
+/*
+ * Stacks are painted, the first byte that differs from the canary
+ * shows the deepest point the task has ever reached
+ */
+
+#define STACK_CANARY        (0xA5)
 
+/* cpu context + exit fn */
+#define STACK_RESERVED      (sizeof(cpu_irqframe_t) + sizeof(void (*)(void)))
 
 static char*
 do_allocatestack (task_t* task, size_t size) {
     if (!size) {
         return NULL;
     }
-    /* cpu_context + exit fn */
-    size += (sizeof(cpu_context_t) +
-             sizeof(void (*)(void)));
-    task->sb = malloc(size);
+    size = CPU_STACK(size) + STACK_RESERVED;
+    task->sb = heap_malloc(&kheap, size);
     if (task->sb) {
+        memset(task->sb, STACK_CANARY, size);
         task->sp = task->sb + size - 1;
+        task->ss = size;
     }
     return (task->sb);
 }
 
+static size_t
+do_stackpeak (task_t* task) {
+    char* it;
+    size_t used;
+    if (!task || !task->sb) {
+        return (0);
+    }
+    for (it = task->sb;
+         (it != (task->sb + task->ss)) && (*it == (char)STACK_CANARY);
+         it++);
+    used = (task->sb + task->ss) - it;
+    return ((used > STACK_RESERVED) ? (used - STACK_RESERVED) : 0);
+}
+
+/*
+ * Statistics of the task after prev, NULL if prev is the last one or
+ * it doesn't exist anymore
+ */
+
+static task_t*
+do_taskstat (task_t* prev, taskstat_t* st) {
+    task_t* task = tasklist;
+    if (prev) {
+        for (; task && (task != prev); task = task->nexttask);
+        if (!task) {
+            return (NULL);
+        }
+        task = task->nexttask;
+    }
+    if (task && st) {
+        st->pid = task;
+        st->prio = task->prio;
+        st->ticks = task->ticks;
+        st->kcalls = task->kcalls;
+        st->sent = task->sent;
+        st->received = task->received;
+        st->preempted = task->preempted;
+        st->stacksize = task->sb ? (task->ss - STACK_RESERVED) : 0;
+        st->stackpeak = do_stackpeak(task);
+    }
+    return (task);
+}
+
 /*
 static void
 do_setstack (task_t* task, char* ptr, size_t size) {
@@ -184,7 +416,8 @@ do_setuptask (task_t* task,
               void* args,
               void (*exitfn)(void)) {
 
-    cpu_context_t* ctxt;
+#ifndef HOST
+    cpu_trapframe_t* frame;
 
     do_pushstack(task, LOW(exittask));
     do_pushstack(task, HIGH(exittask));
@@ -193,84 +426,350 @@ do_setuptask (task_t* task,
         do_pushstack(task, HIGH(exitfn));
     }
 
-    task->sp -= sizeof(cpu_context_t);
+    /* The task starts as if it was returning from a kernel call */
+    task->sp -= sizeof(cpu_trapframe_t);
+    task->flags |= (TASK_FLAG_TRAPFRAME);
+
+    frame = (cpu_trapframe_t*)(task->sp + 1);
+
+    frame->regs.r24 = LOW(args);
+    frame->regs.r25 = HIGH(args);
+    frame->retLow = LOW(tp);
+    frame->retHigh = HIGH(tp);
+#else
+    /* The context sits at the top of the stack, aligned for ucontext */
+    task->sp = (char*)(((uintptr_t)(task->sp + 1) - sizeof(cpu_context_t))
+                       & ~(uintptr_t)15) - 1;
+    task->flags |= (TASK_FLAG_TRAPFRAME);
+    cpu_setupframe(GET_CTXT(task), task->sb, (size_t)(task->sp + 1 - task->sb),
+                   tp, args, exitfn, exittask);
+#endif
 
-    ctxt = (cpu_context_t*)(task->sp + 1);
+    return;
+}
 
-    ctxt->r24 = LOW(args);
-    ctxt->r25 = HIGH(args);
-    ctxt->retLow = LOW(tp);
-    ctxt->retHigh = HIGH(tp);
-    ctxt->r1 = 0;       /* GCC needs r1 to be 0x00 */
 
-    return;
+/*
+ * Bind a task to the slots of the events it waits for
+ * Binds none and returns 0 if another task holds one of the slots.
+ */
+
+static int
+bindevents (task_t* task, unsigned int events) {
+    int i;
+    for (i = 0; i != EVENT_SLOTS; i++) {
+        if ((events & (1 << i)) && eventwaiter[i] && (eventwaiter[i] != task)) {
+            return (0);
+        }
+    }
+    for (i = 0; i != EVENT_SLOTS; i++) {
+        if (events & (1 << i)) {
+            eventwaiter[i] = task;
+        }
+    }
+    return (1);
 }
 
 
+static void
+unbindevents (task_t* task) {
+    int i;
+    for (i = 0; i != EVENT_SLOTS; i++) {
+        if (eventwaiter[i] == task) {
+            eventwaiter[i] = NULL;
+        }
+    }
+    return;
+}
+
 /*
- * Check whether a task waits for an event
+ * Find the task that waits for an event
  */
 
-static q_item_t*
-dispatchevent (q_head_t* que UNUSED, q_item_t* ptsk) {
-    if (GET_KCALLCODE(GET_CTXT((task_t*)ptsk)) != (KCALL_WAITEVENT)) {
-        return (NULL);
+static task_t*
+dispatchevent (unsigned int event) {
+    task_t* task = NULL;
+    int i;
+    for (i = 0; i != EVENT_SLOTS; i++) {
+        if (event & (1 << i)) {
+            task = eventwaiter[i];
+            break;
+        }
     }
-    if (!((GETP0(GET_CTXT((task_t*)ptsk))) & (eventcode))) {
-        return (NULL);
+    if (task) {
+        unbindevents(task);
     }
-    return (ptsk);
+    return (task);
 }
 
 /*
  * Message processing and delivery
+ * A blocked sender sits in the sender_q of its destination and points to
+ * it with 'sendto', a blocked receiver keeps its source in 'rcvfrom' (NULL
+ * if not receiving). The rendez-vous is found without scanning blocked_q.
  */
 
 static int
+isreceiving (task_t* rcvr_task, task_t* sndr_task) {
+    return ((rcvr_task->rcvfrom == sndr_task) ||
+            (rcvr_task->rcvfrom == TASK_ANY));
+}
+
+
+/*
+ * Peer of a message call, short messages keep it in r26:r27
+ */
+
+static task_t*
+getpeer (cpu_context_t* ctxt) {
+    if (IS_SHORT(ctxt)) {
+        return ((task_t*)GETPEER(ctxt));
+    }
+    return ((task_t*)GETP0(ctxt));
+}
+
+
+static void
+setpeer (cpu_context_t* ctxt, task_t* task) {
+    if (IS_SHORT(ctxt)) {
+        SETPEER(ctxt, task);
+    } else {
+        SETP0(ctxt, task);
+    }
+    return;
+}
+
+
+static void
 delivermsg (task_t* rcvr_task, task_t* sndr_task) {
     cpu_context_t *rcvr_ctxt = GET_CTXT(rcvr_task);
     cpu_context_t *sndr_ctxt = GET_CTXT(sndr_task);
+    void*   dst;
+    void*   src;
+    size_t  len;
+
+    sndr_task->sent++;
+    rcvr_task->received++;
+    KTRACE_PUT(KTRACE_MSG, GET_KCALLCODE(sndr_ctxt), sndr_task, rcvr_task);
+    if (IS_SHORT(rcvr_ctxt)) {
+        dst = SMSG(rcvr_ctxt);
+        len = SMSG_SIZE;
+    } else {
+        dst = (void*)GETP1(rcvr_ctxt);
+        len = (size_t)GETP2(rcvr_ctxt);
+    }
+    if (IS_SHORT(sndr_ctxt)) {
+        src = SMSG(sndr_ctxt);
+        len = (len < SMSG_SIZE) ? len : SMSG_SIZE;
+    } else {
+        src = (void*)GETP1(sndr_ctxt);
+    }
+    /* Copy the msg */
+    memcpy(dst, src, len);
+    /* Success, copy the sender's pid to the rcvr */
+    setpeer(rcvr_ctxt, sndr_task);
+    rcvr_task->rcvfrom = NULL;
+    return;
+}
 
-    /* Check if rendez-vous criteria is satisfied */
-    if ((GET_KCALLCODE(sndr_ctxt) != KCALL_SEND) &&
-        (GET_KCALLCODE(sndr_ctxt) != KCALL_SENDREC)) {
-        return (0);
+/*
+ * Returns the queue where a blocked task waits
+ */
+
+static q_head_t*
+waitqueue (task_t* task) {
+    if (task->sendto) {
+        return (&(task->sendto->sender_q));
     }
-    if (GET_KCALLCODE(rcvr_ctxt) != KCALL_RECEIVE) {
-        return (0);
+    return (&blocked_q);
+}
+
+/*
+ * Priority inheritance: a task blocked sending to, or waiting for the
+ * reply of another task lends its priority to that task, and to the
+ * task that one waits for in turn. The loan is paid back when the
+ * borrower replies or goes back to receive.
+ */
+
+static int
+isready (task_t* task) {
+    q_item_t* it;
+    for (it = Q_FIRST(queue[task->prio]); it; it = Q_NEXT(it)) {
+        if (it == (q_item_t*)task) {
+            return (1);
+        }
     }
-    if ((task_t*)GETP0(sndr_ctxt) != rcvr_task) {
-        return (0);
+    return (0);
+}
+
+static void
+inheritprio (task_t* task, unsigned char prio) {
+    while (task && (task != TASK_ANY) && (prio < task->prio)) {
+        if (isready(task)) {
+            Q_END(&queue[prio], Q_REMV(&queue[task->prio], task));
+        }
+        task->prio = prio;
+        task = task->sendto ? task->sendto : task->rcvfrom;
+    }
+    return;
+}
+
+/*
+ * Back to the own priority, or the highest one of the senders still
+ * blocked on the task. Must not be called for a task in a ready queue.
+ */
+
+static void
+restoreprio (task_t* task) {
+    q_item_t* it;
+    task->prio = task->baseprio;
+    for (it = Q_FIRST(task->sender_q); it; it = Q_NEXT(it)) {
+        if (((task_t*)it)->prio < task->prio) {
+            task->prio = ((task_t*)it)->prio;
+        }
+    }
+    return;
+}
+
+/*
+ * Block the current task on the sender queue of the destination
+ */
+
+static void
+blocksender (task_t* dest) {
+    if (!dest || (dest == TASK_ANY)) {
+        /* Nobody will ever receive this */
+        Q_END(&blocked_q, Q_REMV(&current_q, CURRENT));
+        return;
+    }
+    CURRENT->sendto = dest;
+    inheritprio(dest, CURRENT->prio);
+    Q_END(&(dest->sender_q), Q_REMV(&current_q, CURRENT));
+    return;
+}
+
+/*
+ * Find a sender blocked on the receiver
+ */
+
+static task_t*
+findsender (task_t* rcvr_task, task_t* src) {
+    if (src == TASK_ANY) {
+        return ((task_t*)Q_FIRST(rcvr_task->sender_q));
+    }
+    if (src && (src->sendto == rcvr_task)) {
+        return (src);
+    }
+    return (NULL);
+}
+
+static int trytoreceive (task_t* rcvr_task);
+
+/*
+ * Sender's message has been delivered, take it off the sender queue
+ */
+
+static void
+releasesender (task_t* sndr_task) {
+    task_t* rcvr_task = sndr_task->sendto;
+    cpu_context_t *sndr_ctxt = GET_CTXT(sndr_task);
+
+    Q_REMV(&(rcvr_task->sender_q), sndr_task);
+    sndr_task->sendto = NULL;
+    switch (GET_IPCCODE(sndr_ctxt)) {
+      case KCALL_SENDREC:
+        /* msg received, put sender in RCV state */
+        SET_KCALLCODE(sndr_ctxt, KCALL_RECEIVE | IS_SHORT(sndr_ctxt));
+        sndr_task->rcvfrom = rcvr_task;
+        Q_END(&blocked_q, sndr_task);
+        break;
+      case KCALL_REPLYRECV:
+        /* reply received, sender receives from anyone */
+        SET_KCALLCODE(sndr_ctxt, KCALL_RECEIVE | IS_SHORT(sndr_ctxt));
+        setpeer(sndr_ctxt, TASK_ANY);
+        if (trytoreceive(sndr_task)) {
+            Q_END(&queue[sndr_task->prio], sndr_task);
+        } else {
+            Q_END(&blocked_q, sndr_task);
+        }
+        break;
+      default:
+        Q_END(&queue[sndr_task->prio], sndr_task);
+        break;
+    }
+    return;
+}
+
+/*
+ * Receive for a task in RCV state: pending notifications first, then
+ * blocked senders. Returns 0 if there's nothing to receive, the task
+ * has to be blocked then.
+ */
+
+static int
+trytoreceive (task_t* rcvr_task) {
+    cpu_context_t *rcvr_ctxt = GET_CTXT(rcvr_task);
+    task_t* src = getpeer(rcvr_ctxt);
+    task_t* sndr_task;
+
+    if ((src == TASK_ANY) && rcvr_task->pending) {
+        /* notifications come first */
+        setpeer(rcvr_ctxt, TASK_NOTIFY);
+        return (1);
     }
-    if (((task_t*)GETP0(rcvr_ctxt) != sndr_task) &&
-        ((task_t*)GETP0(rcvr_ctxt) != TASK_ANY)) {
+    sndr_task = findsender(rcvr_task, src);
+    if (!sndr_task) {
+        rcvr_task->rcvfrom = src;
+        restoreprio(rcvr_task);
         return (0);
     }
-    /* Copy the msg */
-    memcpy((void*)GETP1(rcvr_ctxt),
-           (void*)GETP1(sndr_ctxt),
-           (size_t)GETP2(rcvr_ctxt));
-    /* Success, copy the sender's pid to the rcvr */
-    SETP0(rcvr_ctxt, sndr_task);
+    if (src != TASK_ANY) {
+        /* sender replies */
+        restoreprio(sndr_task);
+    }
+    delivermsg(rcvr_task, sndr_task);
+    releasesender(sndr_task);
     return (1);
 }
 
+/*
+ * Senders of a deleted task stay blocked forever, as nobody
+ * will receive their messages
+ */
 
-static q_item_t*
-sendmsg (q_head_t* que UNUSED, q_item_t* ptsk) {
-    if (delivermsg((task_t*)ptsk, CURRENT)) {
-        return (ptsk);
+static void
+orphansenders (task_t* task) {
+    task_t* it;
+    while ((it = (task_t*)Q_FIRST(task->sender_q))) {
+        it->sendto = NULL;
+        Q_END(&blocked_q, Q_REMV(&(task->sender_q), it));
     }
-    return (NULL);
+    return;
 }
 
+/*
+ * Wake up a task blocked in IPC. If the CPU is free (the caller has just
+ * blocked) and no task of higher priority is ready, the woken task runs
+ * right away, without a pass through the scheduler.
+ */
+
+static void
+wakeup (task_t* task) {
+    int prio;
 
-static q_item_t*
-receivemsg (q_head_t* que UNUSED, q_item_t* ptsk) {
-    if (delivermsg(CURRENT, (task_t*)ptsk)) {
-        return (ptsk);
+    if (CURRENT) {
+        Q_END(&queue[task->prio], task);
+        return;
     }
-    return (NULL);
+    for (prio = 0; prio < task->prio; prio++) {
+        if (Q_FIRST(queue[prio])) {
+            Q_END(&queue[task->prio], task);
+            return;
+        }
+    }
+    /* Direct handoff */
+    Q_FRONT(&current_q, task);
+    return;
 }
 
 /*
@@ -309,6 +808,7 @@ inittask (void(*ptp)(void* args), void* args, size_t stack, unsigned char prio)
     }
     do_setuptask(task, ptp, args, NULL);
     task->prio = prio;
+    task->baseprio = prio;
     Q_END(&queue[task->prio], task);
     return (task);
 }
@@ -319,7 +819,11 @@ inittask (void(*ptp)(void* args), void* args, size_t stack, unsigned char prio)
  */
 void
 kernel (void(*ptp)(void* args), void* args, size_t stack, unsigned char prio) {
+    void*       mem;
+    size_t      size;
     LOCK();     /* In theory this is unnecessary */
+    mem = cpu_heap(KERNEL_STACK_MARGIN, &size);
+    heap_init(&kheap, mem, size);
     init_task_queues();
     inittask(idle_task, NULL, 0x80, TASK_PRIO_IDLE);
     inittask(ptp, args, stack, prio);
@@ -329,19 +833,24 @@ kernel (void(*ptp)(void* args), void* args, size_t stack, unsigned char prio) {
         pid_t           wtask;
         pid_t           old;
         cpu_context_t   *ctxt;
+        unsigned int    clock;
         scheduler();
+        clock = cpu_clock();
         switch_from_kernel();
 
         /* kernel re-entry point */
 
         old = CURRENT;
         ctxt = GET_CTXT(CURRENT);
+        old->ticks += (uint16_t)(cpu_clock() - clock);
 
         /* handle event */
         if (eventcode != EVENT_NONE) {
             /* Check whether any task waits for this event */
-            wtask = (pid_t) q_forall(&blocked_q, dispatchevent);
+            wtask = dispatchevent(eventcode);
+            KTRACE_PUT(KTRACE_EVENT, eventcode, old, wtask);
             if (wtask) {
+                old->preempted++;
                 if ((GETP0(GET_CTXT((task_t*)wtask))) & (PREEMPT_ON_EVENT)) {
                     /* Do preemption */
                     Q_END(&queue[old->prio], Q_REMV(&current_q, CURRENT));
@@ -357,12 +866,17 @@ kernel (void(*ptp)(void* args), void* args, size_t stack, unsigned char prio) {
         }
 
         /* handle kernel call*/
+        old->kcalls++;
+        KTRACE_PUT(KTRACE_KCALL, GET_KCALLCODE(ctxt), old,
+                   ((GET_KCALLCODE(ctxt) & 0xF0) == KCALL_SEND) ?
+                   getpeer(ctxt) : (task_t*)GETP0(ctxt));
         switch (GET_KCALLCODE(ctxt)) {
 
           case KCALL_CREATETASK:
             wtask = (pid_t) Q_FRONT(&blocked_q, newtask());
             if (wtask) {
                 wtask->prio = (unsigned char)GETP0(ctxt);
+                wtask->baseprio = wtask->prio;
                 wtask->page = (char)GETP1(ctxt);
                 wtask->sb = NULL;
             }
@@ -383,24 +897,31 @@ kernel (void(*ptp)(void* args), void* args, size_t stack, unsigned char prio) {
           case KCALL_STARTTASK:      /* Start a task */
             wtask = (pid_t)GETP0(ctxt);
              /* put new task at the end of rdy queue */
-            Q_END(&queue[wtask->prio], Q_REMV(&blocked_q, wtask));
+            Q_END(&queue[wtask->prio], Q_REMV(waitqueue(wtask), wtask));
+            wtask->sendto = NULL;
+            wtask->rcvfrom = NULL;
             break;
 
           case KCALL_STOPTASK:       /* Delete the stack of a blocked task */
             wtask = (pid_t)GETP0(ctxt);
             if (wtask->sb) {
-                free(wtask->sb);
+                heap_free(&kheap, wtask->sb);
                 wtask->sb = NULL;
+                wtask->ss = 0;
             }
             break;
 
           case KCALL_DELETETASK:     /* Delete a blocked task */
-            free((void*)Q_REMV(&blocked_q, (pid_t)GETP0(ctxt)));
+            wtask = (pid_t)GETP0(ctxt);
+            unbindevents(wtask);
+            orphansenders(wtask);
+            freetask((task_t*)Q_REMV(waitqueue(wtask), wtask));
             break;
 
           case KCALL_EXITTASK:       /* Current task exits */
-            free(CURRENT->sb);
-            free(Q_REMV(&current_q, CURRENT));
+            orphansenders(CURRENT);
+            heap_free(&kheap, CURRENT->sb);
+            freetask((task_t*)Q_REMV(&current_q, CURRENT));
             break;
 
           case KCALL_IRQEN:          /* Enable interrupts */
@@ -412,54 +933,124 @@ kernel (void(*ptp)(void* args), void* args, size_t stack, unsigned char prio) {
             break;
 
           case KCALL_WAITEVENT:      /* Block task until an event occurs */
+            if (!bindevents(CURRENT, (unsigned int)GETP0(ctxt))) {
+                SETP0(ctxt, EVENT_NONE);    /* slot owned by another task */
+                break;
+            }
             Q_END(&blocked_q, Q_REMV(&current_q, CURRENT));
             break;
 
           case KCALL_MALLOC:         /* Allocate memory */
-            SETP0(ctxt, malloc((size_t)GETP0(ctxt)));
+            SETP0(ctxt, heap_malloc(&kheap, (size_t)GETP0(ctxt)));
             break;
 
           case KCALL_FREE:           /* Free memory */
-            free((void*)GETP0(ctxt));
+            heap_free(&kheap, (void*)GETP0(ctxt));
             break;
 
           case KCALL_GETPID:         /* Get pid */
             SETP0(ctxt, CURRENT);
             break;
 
-          case KCALL_SEND:           /* Send a message */
-            wtask = (task_t*) q_forall(&blocked_q, sendmsg);
-            if (!wtask) {
-                /* cannot deliver, block sending task */
-                Q_FRONT(&blocked_q, Q_REMV(&current_q, CURRENT));
-            } else {
-                Q_END(&queue[wtask->prio], Q_REMV(&blocked_q, wtask));
-            }
+          case KCALL_STACKPEAK:      /* Peak stack usage */
+            SETP0(ctxt, do_stackpeak((task_t*)GETP0(ctxt)));
+            break;
+
+          case KCALL_KTRACE:         /* Drain the trace ring */
+            SETP0(ctxt, do_ktrace((ktrace_t*)GETP0(ctxt), (int)GETP1(ctxt)));
+            break;
+
+          case KCALL_TASKDATA:       /* Get the task data word */
+            SETP0(ctxt, CURRENT->data);
+            break;
+
+          case KCALL_SETTASKDATA:    /* Set the task data word of a task */
+            ((task_t*)GETP0(ctxt))->data = (void*)GETP1(ctxt);
             break;
 
+          case KCALL_TASKSTAT:       /* Statistics of the next task */
+            SETP0(ctxt, do_taskstat((task_t*)GETP0(ctxt),
+                                    (taskstat_t*)GETP1(ctxt)));
+            break;
+
+          case KCALL_SEND:           /* Send a message */
+          case KCALL_SENDS:
           case KCALL_SENDREC:        /* Send a message, then receive */
-            wtask = (task_t*) q_forall(&blocked_q, sendmsg);
-            if (wtask) {
+          case KCALL_SENDRECS:
+            wtask = getpeer(ctxt);
+            if (!wtask || (wtask == TASK_ANY) || !isreceiving(wtask, CURRENT)) {
+                /* cannot deliver, block sending task */
+                blocksender(wtask);
+                break;
+            }
+            if (wtask->rcvfrom == CURRENT) {
+                /* reply, pay back the priority loan */
+                restoreprio(CURRENT);
+            }
+            delivermsg(wtask, CURRENT);
+            Q_REMV(&blocked_q, wtask);
+            if (GET_IPCCODE(ctxt) == KCALL_SENDREC) {
                 /* msg delivered, put CURRENT in RCV state */
-                SET_KCALLCODE(ctxt, KCALL_RECEIVE);
-                Q_END(&queue[wtask->prio], Q_REMV(&blocked_q, wtask));
+                SET_KCALLCODE(ctxt, KCALL_RECEIVE | IS_SHORT(ctxt));
+                CURRENT->rcvfrom = wtask;
+                inheritprio(wtask, CURRENT->prio);
+                Q_END(&blocked_q, Q_REMV(&current_q, CURRENT));
             }
-            Q_FRONT(&blocked_q, Q_REMV(&current_q, CURRENT));
+            /* receiver runs in place of a blocked sender */
+            wakeup(wtask);
             break;
 
           case KCALL_RECEIVE:        /* Receive a message */
-            wtask = (task_t*) q_forall(&blocked_q, receivemsg);
-            if (!wtask) {
+          case KCALL_RECEIVES:
+            if (!trytoreceive(CURRENT)) {
                 /* no sender, block receiving task */
-                Q_FRONT(&blocked_q, Q_REMV(&current_q, CURRENT));
-            } else {
-                if (GET_KCALLCODE(GET_CTXT(wtask)) == KCALL_SENDREC) {
-                    /* msg received, put sender in RCV state */
-                    SET_KCALLCODE(GET_CTXT(wtask), KCALL_RECEIVE);
-                } else {
-                    Q_END(&queue[wtask->prio], Q_REMV(&blocked_q, wtask));
+                Q_END(&blocked_q, Q_REMV(&current_q, CURRENT));
+            }
+            break;
+
+          case KCALL_REPLYRECV:      /* Reply (if any), then receive */
+          case KCALL_REPLYRECVS:
+            wtask = getpeer(ctxt);
+            if (wtask) {
+                if ((wtask == TASK_ANY) || !isreceiving(wtask, CURRENT)) {
+                    /* cannot deliver, block sending task */
+                    blocksender(wtask);
+                    break;
+                }
+                if (wtask->rcvfrom == CURRENT) {
+                    restoreprio(CURRENT);
                 }
+                delivermsg(wtask, CURRENT);
+                Q_REMV(&blocked_q, wtask);
+            }
+            SET_KCALLCODE(ctxt, KCALL_RECEIVE | IS_SHORT(ctxt));
+            setpeer(ctxt, TASK_ANY);
+            if (!trytoreceive(CURRENT)) {
+                Q_END(&blocked_q, Q_REMV(&current_q, CURRENT));
             }
+            if (wtask) {
+                /* client runs in place of an idle server */
+                wakeup(wtask);
+            }
+            break;
+
+          case KCALL_NOTIFY:         /* Post notification bits, never blocks */
+            wtask = (task_t*)GETP0(ctxt);
+            if (!wtask || (wtask == TASK_ANY)) {
+                break;
+            }
+            wtask->pending |= (unsigned int)GETP1(ctxt);
+            if (wtask->rcvfrom == TASK_ANY) {
+                /* receiver is waiting, wake it up */
+                setpeer(GET_CTXT(wtask), TASK_NOTIFY);
+                wtask->rcvfrom = NULL;
+                Q_END(&queue[wtask->prio], Q_REMV(&blocked_q, wtask));
+            }
+            break;
+
+          case KCALL_GETNOTIFY:      /* Fetch and clear notification bits */
+            SETP0(ctxt, CURRENT->pending);
+            CURRENT->pending = 0;
             break;
 
           case KCALL_YIELD:          /* Let other tasks running */
@@ -477,6 +1068,8 @@ kernel (void(*ptp)(void* args), void* args, size_t stack, unsigned char prio) {
 ================================================================================
 */
 
+#ifndef HOST
+
 pid_t
 getpid (void) {
     register pid_t ret __asm__ ("r24");
@@ -539,6 +1132,146 @@ receive (pid_t src UNUSED, void* msg UNUSED, size_t len UNUSED) {
 }
 
 
+/*
+ * Short messages: the payload travels in r18..r25 and the peer in
+ * r26:r27, both ways
+ */
+
+pid_t
+sends (pid_t dest, smsg_t* msg) {
+    smsg_t                  m = *msg;
+    register pid_t          peer __asm__ ("r26");
+    register unsigned int   w0 __asm__ ("r18");
+    register unsigned int   w1 __asm__ ("r20");
+    register unsigned int   w2 __asm__ ("r22");
+    register unsigned int   w3 __asm__ ("r24");
+
+    w0 = m.w[0]; w1 = m.w[1]; w2 = m.w[2]; w3 = m.w[3];
+    peer = dest;
+    KERNEL_CALL_SHORT(KCALL_SENDS, peer, w0, w1, w2, w3);
+    return (peer);
+}
+
+
+pid_t
+receives (pid_t src, smsg_t* msg) {
+    smsg_t                  m;
+    register pid_t          peer __asm__ ("r26");
+    register unsigned int   w0 __asm__ ("r18");
+    register unsigned int   w1 __asm__ ("r20");
+    register unsigned int   w2 __asm__ ("r22");
+    register unsigned int   w3 __asm__ ("r24");
+
+    w0 = 0; w1 = 0; w2 = 0; w3 = 0;
+    peer = src;
+    KERNEL_CALL_SHORT(KCALL_RECEIVES, peer, w0, w1, w2, w3);
+    m.w[0] = w0; m.w[1] = w1; m.w[2] = w2; m.w[3] = w3;
+    src = peer;
+    *msg = m;
+    return (src);
+}
+
+
+pid_t
+sendrecs (pid_t dest, smsg_t* msg) {
+    smsg_t                  m = *msg;
+    register pid_t          peer __asm__ ("r26");
+    register unsigned int   w0 __asm__ ("r18");
+    register unsigned int   w1 __asm__ ("r20");
+    register unsigned int   w2 __asm__ ("r22");
+    register unsigned int   w3 __asm__ ("r24");
+
+    w0 = m.w[0]; w1 = m.w[1]; w2 = m.w[2]; w3 = m.w[3];
+    peer = dest;
+    KERNEL_CALL_SHORT(KCALL_SENDRECS, peer, w0, w1, w2, w3);
+    m.w[0] = w0; m.w[1] = w1; m.w[2] = w2; m.w[3] = w3;
+    dest = peer;
+    *msg = m;
+    return (dest);
+}
+
+
+pid_t
+replyrecv (pid_t dest UNUSED, void* msg UNUSED, size_t len UNUSED) {
+    register pid_t ret __asm__ ("r24");
+    KERNEL_CALL(KCALL_REPLYRECV);
+    return (ret);
+}
+
+
+pid_t
+replyrecvs (pid_t dest, smsg_t* msg) {
+    smsg_t                  m = *msg;
+    register pid_t          peer __asm__ ("r26");
+    register unsigned int   w0 __asm__ ("r18");
+    register unsigned int   w1 __asm__ ("r20");
+    register unsigned int   w2 __asm__ ("r22");
+    register unsigned int   w3 __asm__ ("r24");
+
+    w0 = m.w[0]; w1 = m.w[1]; w2 = m.w[2]; w3 = m.w[3];
+    peer = dest;
+    KERNEL_CALL_SHORT(KCALL_REPLYRECVS, peer, w0, w1, w2, w3);
+    m.w[0] = w0; m.w[1] = w1; m.w[2] = w2; m.w[3] = w3;
+    dest = peer;
+    *msg = m;
+    return (dest);
+}
+
+
+void
+notify (pid_t dest UNUSED, unsigned int bits UNUSED) {
+    KERNEL_CALL(KCALL_NOTIFY);
+    return;
+}
+
+
+unsigned int
+getnotify (void) {
+    register unsigned int ret __asm__ ("r24");
+    KERNEL_CALL(KCALL_GETNOTIFY);
+    return (ret);
+}
+
+
+pid_t
+taskstat (pid_t prev UNUSED, taskstat_t* st UNUSED) {
+    register pid_t ret __asm__ ("r24");
+    KERNEL_CALL(KCALL_TASKSTAT);
+    return (ret);
+}
+
+
+size_t
+stackpeak (pid_t pid UNUSED) {
+    register size_t ret __asm__ ("r24");
+    KERNEL_CALL(KCALL_STACKPEAK);
+    return (ret);
+}
+
+
+int
+ktrace (ktrace_t* buf UNUSED, int n UNUSED) {
+    register int ret __asm__ ("r24");
+    KERNEL_CALL(KCALL_KTRACE);
+    return (ret);
+}
+
+
+void*
+taskdata (void) {
+    register void* ret __asm__ ("r24");
+    KERNEL_CALL(KCALL_TASKDATA);
+    return (ret);
+}
+
+
+void
+settaskdata (pid_t pid UNUSED, void* data UNUSED) {
+    KERNEL_CALL(KCALL_SETTASKDATA);
+    return;
+}
+
+
 pid_t
 createtask (unsigned char prio UNUSED, char page UNUSED) {
     register pid_t ret __asm__ ("r24");
@@ -608,4 +1341,134 @@ kirqdis(void) {
     return;
 }
 
+#else /* HOST */
+
+/*
+ * The parameters go to the context at the top of the stack instead of
+ * registers, the result comes back in the first one
+ */
+static uintptr_t
+kcall (unsigned char code,
+       uintptr_t p0, uintptr_t p1, uintptr_t p2, uintptr_t p3) {
+    cpu_context_t* ctxt;
+    LOCK();
+    ctxt = GET_CTXT(CURRENT);
+    SET_KCALLCODE(ctxt, code);
+    SETP0(ctxt, p0);
+    SETP1(ctxt, p1);
+    SETP2(ctxt, p2);
+    SETP3(ctxt, p3);
+    traptokernel();
+    return (GETP0(ctxt));
+}
+
+
+static pid_t
+kcall_short (unsigned char code, pid_t peer, smsg_t* msg) {
+    cpu_context_t* ctxt;
+    LOCK();
+    ctxt = GET_CTXT(CURRENT);
+    SET_KCALLCODE(ctxt, code);
+    SETPEER(ctxt, peer);
+    memcpy(SMSG(ctxt), msg, SMSG_SIZE);
+    traptokernel();
+    if (code != KCALL_SENDS) {
+        memcpy(msg, SMSG(ctxt), SMSG_SIZE);
+    }
+    return ((pid_t)GETPEER(ctxt));
+}
+
+#define KCALL0(c)               kcall((c), 0, 0, 0, 0)
+#define KCALL1(c, a)            kcall((c), (uintptr_t)(a), 0, 0, 0)
+#define KCALL2(c, a, b)         kcall((c), (uintptr_t)(a), (uintptr_t)(b), 0, 0)
+#define KCALL3(c, a, b, d)                                              \
+    kcall((c), (uintptr_t)(a), (uintptr_t)(b), (uintptr_t)(d), 0)
+
+
+pid_t getpid (void) { return ((pid_t)KCALL0(KCALL_GETPID)); }
+
+void yield (void) { KCALL0(KCALL_YIELD); }
+
+int waitevent (int event) { return ((int)KCALL1(KCALL_WAITEVENT, event)); }
+
+void* kmalloc (size_t size) { return ((void*)KCALL1(KCALL_MALLOC, size)); }
+
+void kfree (void* ptr) { KCALL1(KCALL_FREE, ptr); }
+
+pid_t
+send (pid_t dest, void* msg) {
+    return ((pid_t)KCALL2(KCALL_SEND, dest, msg));
+}
+
+pid_t
+sendrec (pid_t tsk, void* msg, size_t len) {
+    return ((pid_t)KCALL3(KCALL_SENDREC, tsk, msg, len));
+}
+
+pid_t
+receive (pid_t src, void* msg, size_t len) {
+    return ((pid_t)KCALL3(KCALL_RECEIVE, src, msg, len));
+}
+
+pid_t
+replyrecv (pid_t dest, void* msg, size_t len) {
+    return ((pid_t)KCALL3(KCALL_REPLYRECV, dest, msg, len));
+}
+
+pid_t sends (pid_t dest, smsg_t* msg) { return (kcall_short(KCALL_SENDS, dest, msg)); }
+
+pid_t receives (pid_t src, smsg_t* msg) { return (kcall_short(KCALL_RECEIVES, src, msg)); }
+
+pid_t sendrecs (pid_t dest, smsg_t* msg) { return (kcall_short(KCALL_SENDRECS, dest, msg)); }
+
+pid_t replyrecvs (pid_t dest, smsg_t* msg) { return (kcall_short(KCALL_REPLYRECVS, dest, msg)); }
+
+void notify (pid_t dest, unsigned int bits) { KCALL2(KCALL_NOTIFY, dest, bits); }
+
+unsigned int getnotify (void) { return ((unsigned int)KCALL0(KCALL_GETNOTIFY)); }
+
+pid_t
+taskstat (pid_t prev, taskstat_t* st) {
+    return ((pid_t)KCALL2(KCALL_TASKSTAT, prev, st));
+}
+
+size_t stackpeak (pid_t pid) { return ((size_t)KCALL1(KCALL_STACKPEAK, pid)); }
+
+int ktrace (ktrace_t* buf, int n) { return ((int)KCALL2(KCALL_KTRACE, buf, n)); }
+
+void* taskdata (void) { return ((void*)KCALL0(KCALL_TASKDATA)); }
+
+void settaskdata (pid_t pid, void* data) { KCALL2(KCALL_SETTASKDATA, pid, data); }
+
+pid_t
+createtask (unsigned char prio, char page) {
+    return ((pid_t)KCALL2(KCALL_CREATETASK, prio, page));
+}
+
+char*
+allocatestack (pid_t pid, size_t size) {
+    return ((char*)KCALL2(KCALL_ALLOCATESTACK, pid, size));
+}
+
+void
+setuptask (pid_t pid,
+           void(*ptsk)(void* args),
+           void* args,
+           void(*exitfn)(void)) {
+    kcall(KCALL_SETUPTASK, (uintptr_t)pid, (uintptr_t)ptsk,
+          (uintptr_t)args, (uintptr_t)exitfn);
+}
+
+void starttask (pid_t pid) { KCALL1(KCALL_STARTTASK, pid); }
+
+void stoptask (pid_t pid) { KCALL1(KCALL_STOPTASK, pid); }
+
+void deletetask (pid_t pid) { KCALL1(KCALL_DELETETASK, pid); }
+
+void exittask (void) { KCALL0(KCALL_EXITTASK); }
+
+void kirqen (void) { KCALL0(KCALL_IRQEN); }
+
+void kirqdis (void) { KCALL0(KCALL_IRQDIS); }
 
+#endif /* HOST */
@@ -19,18 +19,66 @@ enum {
 
 typedef struct task_s* pid_t;
 
-/* EVENTS */
+/* EVENTS
+ * Every event has one waiter slot: waitevent() binds the task to the slot
+ * of each requested event and the dispatcher looks the handler up in the
+ * slot table. If another task holds one of the slots, waitevent() binds
+ * none and returns EVENT_NONE at once. The interrupt-to-handler latency is
+ * one kernel entry, at most EVENT_SLOTS lookups and one context restore,
+ * regardless of the number of tasks in the system.
+ */
 #define EVENT_NONE          (0x0000)
 #define EVENT_TIMER1OVF     (0x0001)
 #define EVENT_USART0RX      (0x0002)
 #define EVENT_USART0TX      (0x0004)
 #define EVENT_USART1RX      (0x0008)
 #define EVENT_USART1TX      (0x0010)
+#define EVENT_TIMER1COMPA   (0x0020)
+
+#define EVENT_SLOTS         (6)
 
 #define PREEMPT_ON_EVENT    (0x8000)
 
 /* PID */
+#define TASK_MAX    (24)            /* tasks in the system, at most */
 #define TASK_ANY    ((pid_t)(0xFFFF))
+#define TASK_NOTIFY ((pid_t)(0xFFFE))   /* receive() woken by notify() */
+
+/* SHORT MESSAGE, carried in registers instead of memory buffers.
+ * Four pointers wide: 8 bytes on the AVR, the host build needs more */
+#define SMSG_BYTES  (4 * sizeof(void*))
+
+typedef union smsg_u {
+    unsigned char   b[SMSG_BYTES];
+    unsigned int    w[SMSG_BYTES / sizeof(int)];
+} smsg_t;
+
+/* TASK STATISTICS, see taskstat() */
+typedef struct taskstat_s {
+    pid_t           pid;
+    unsigned char   prio;
+    unsigned long   ticks;          /* CPU time, Timer1 counts */
+    unsigned int    kcalls;         /* kernel calls issued */
+    unsigned int    sent;           /* messages sent */
+    unsigned int    received;       /* messages received */
+    unsigned int    preempted;      /* times an event handler took over */
+    size_t          stacksize;      /* as given to allocatestack() */
+    size_t          stackpeak;      /* see stackpeak() */
+} taskstat_t;
+
+/* KERNEL TRACE RECORD, see ktrace(). The ring is only compiled in with
+ * -DKTRACE, ktrace() returns no records otherwise. */
+typedef struct ktrace_s {
+    unsigned int    time;           /* Timer1 counter */
+    unsigned char   type;           /* KTRACE_* */
+    unsigned char   code;           /* kcall code / event bits */
+    pid_t           task;           /* current task / sender */
+    pid_t           peer;           /* peer task / receiver / handler */
+} ktrace_t;
+
+#define KTRACE_KCALL        ('K')   /* kernel call */
+#define KTRACE_EVENT        ('E')   /* interrupt event */
+#define KTRACE_MSG          ('M')   /* message delivered */
 
 /* DEFAULT STACK SIZE */
 #define DEFAULT_STACK_SIZE  ((size_t)(160))
@@ -66,6 +114,39 @@ pid_t receive(pid_t src, void* msg, size_t len);
 
 pid_t sendrec(pid_t src, void* msg, size_t len);
 
+pid_t sends(pid_t dest, smsg_t* msg);
+
+pid_t receives(pid_t src, smsg_t* msg);
+
+pid_t sendrecs(pid_t dest, smsg_t* msg);
+
+/* Server loops: reply to dest (NULL: no reply) and receive from anyone */
+pid_t replyrecv(pid_t dest, void* msg, size_t len);
+
+pid_t replyrecvs(pid_t dest, smsg_t* msg);
+
+void notify(pid_t dest, unsigned int bits);
+
+unsigned int getnotify(void);
+
+/* Fills st for the task after prev (NULL: the first one), returns its
+ * pid, or NULL at the end of the list */
+pid_t taskstat(pid_t prev, taskstat_t* st);
+
+/* Peak stack usage of a task, comparable with the size given to
+ * allocatestack() */
+size_t stackpeak(pid_t pid);
+
+/* Moves at most n of the oldest trace records to buf, returns their
+ * number */
+int ktrace(ktrace_t* buf, int n);
+
+/* One word per task for the user level libraries, NULL for a new task.
+ * Any task may set it for another one (PM does on exec) */
+void* taskdata(void);
+
+void settaskdata(pid_t pid, void* data);
+
 void* kmalloc (size_t size);
 
 void kfree (void* ptr);
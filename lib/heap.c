@@ -0,0 +1,213 @@
+#include <stddef.h>
+#include "heap.h"
+
+/*
+ *    HEAP - Boundary tag allocator with segregated free lists
+ *
+ *    allocated:  | size|f | data ...                        |
+ *    free:       | size|f | next | prev | ...        | size |
+ *
+ *    Sizes are multiples of HEAP_ALIGN, the low bits carry the flags.
+ *    HEAP_PREVFREE tells that the block below is free and its size is
+ *    the word just before this header. The heap ends in a zero sized,
+ *    allocated sentinel, so the block above always exists.
+ */
+
+#define HEAP_FREE       (0x01)      /* this block is free */
+#define HEAP_PREVFREE   (0x02)      /* the block below is free */
+#define HEAP_FLAGS      (HEAP_FREE | HEAP_PREVFREE)
+
+#define BSIZE(b)        ((b)->head & ~(size_t)HEAP_FLAGS)
+#define BNEXT(b)        ((hblock_t*)((char*)(b) + BSIZE(b)))
+#define BFOOT(b)        (*(size_t*)((char*)(b) + BSIZE(b) - sizeof(size_t)))
+
+/*
+ * Size class: floor(log2(size / HEAP_MIN)), the last class is open
+ */
+static unsigned char
+heap_class (size_t size) {
+    unsigned char c = 0;
+    size /= HEAP_MIN;
+    while ((size >>= 1) && (c != HEAP_BINS - 1)) {
+        c++;
+    }
+    return (c);
+}
+
+static void
+heap_link (heap_t* heap, hblock_t* b) {
+    unsigned char c = heap_class(BSIZE(b));
+    b->prev = NULL;
+    b->next = heap->bin[c];
+    if (b->next) {
+        b->next->prev = b;
+    }
+    heap->bin[c] = b;
+    heap->bitmap |= (1U << c);
+    BFOOT(b) = BSIZE(b);
+}
+
+static void
+heap_unlink (heap_t* heap, hblock_t* b) {
+    unsigned char c = heap_class(BSIZE(b));
+    if (b->next) {
+        b->next->prev = b->prev;
+    }
+    if (b->prev) {
+        b->prev->next = b->next;
+    } else {
+        heap->bin[c] = b->next;
+        if (!b->next) {
+            heap->bitmap &= ~(1U << c);
+        }
+    }
+}
+
+/*
+ * First non-empty class above c, a fixed number of steps
+ */
+static hblock_t*
+heap_above (heap_t* heap, unsigned char c) {
+    unsigned int mask = heap->bitmap >> c;
+    while (mask >>= 1) {
+        c++;
+        if (mask & 1) {
+            return (heap->bin[c]);
+        }
+    }
+    return (NULL);
+}
+
+/**
+ * heap_init - set up a heap on a memory region
+ *   param1[in]: pointer to the heap
+ *   param2[in]: start of the region
+ *   param3[in]: size of the region in bytes
+ */
+void
+heap_init (heap_t* heap, void* mem, size_t size) {
+    hblock_t* b;
+    unsigned char c;
+    if (!heap) return;
+    for (c = 0; c != HEAP_BINS; c++) {
+        heap->bin[c] = NULL;
+    }
+    heap->bitmap = 0;
+    heap->free = 0;
+    heap->low = 0;
+    heap->fails = 0;
+    heap->start = heap->end = (char*)mem;
+    if (!mem || size < HEAP_MIN + HEAP_ALIGN) {
+        return;
+    }
+    size = (size - HEAP_HEAD) & ~(HEAP_ALIGN - 1);
+    b = (hblock_t*)mem;
+    b->head = size | HEAP_FREE;
+    heap->end = (char*)mem + size;
+    ((hblock_t*)heap->end)->head = HEAP_PREVFREE;    /* sentinel */
+    heap_link(heap, b);
+    heap->free = heap->low = size;
+}
+
+/**
+ * heap_malloc - allocate a block
+ *   param1[in]: pointer to the heap
+ *   param2[in]: requested bytes
+ *   return: pointer to the data or NULL
+ */
+void*
+heap_malloc (heap_t* heap, size_t len) {
+    hblock_t* b;
+    hblock_t* rest;
+    size_t size;
+    unsigned char c;
+    if (!heap || !len || len > (size_t)(heap->end - heap->start)) {
+        return (NULL);
+    }
+    size = HEAP_ROUND(len + HEAP_HEAD);
+    if (size < HEAP_MIN) {
+        size = HEAP_MIN;
+    }
+    c = heap_class(size);
+    /* every block of a higher class fits, take the head */
+    b = heap_above(heap, c);
+    if (!b) {
+        /* only the own class is left, first fit */
+        for (b = heap->bin[c]; b && BSIZE(b) < size; b = b->next)
+            ;
+    }
+    if (!b) {
+        heap->fails++;
+        return (NULL);
+    }
+    heap_unlink(heap, b);
+    if (BSIZE(b) - size >= HEAP_MIN) {
+        /* split, the rest stays free */
+        rest = (hblock_t*)((char*)b + size);
+        rest->head = (BSIZE(b) - size) | HEAP_FREE;
+        heap_link(heap, rest);
+        b->head = size;
+    } else {
+        size = BSIZE(b);
+        b->head = size;
+        BNEXT(b)->head &= ~(size_t)HEAP_PREVFREE;
+    }
+    heap->free -= size;
+    if (heap->free < heap->low) {
+        heap->low = heap->free;
+    }
+    return ((char*)b + HEAP_HEAD);
+}
+
+/**
+ * heap_free - release a block and merge it with its free neighbours
+ *   param1[in]: pointer to the heap
+ *   param2[in]: pointer returned by heap_malloc or NULL
+ */
+void
+heap_free (heap_t* heap, void* p) {
+    hblock_t* b;
+    hblock_t* n;
+    size_t size;
+    if (!heap || !p) {
+        return;
+    }
+    b = (hblock_t*)((char*)p - HEAP_HEAD);
+    size = BSIZE(b);
+    heap->free += size;
+    n = BNEXT(b);
+    if (n->head & HEAP_FREE) {
+        heap_unlink(heap, n);
+        size += BSIZE(n);
+    }
+    if (b->head & HEAP_PREVFREE) {
+        n = (hblock_t*)((char*)b - *(size_t*)((char*)b - sizeof(size_t)));
+        heap_unlink(heap, n);
+        size += BSIZE(n);
+        b = n;
+    }
+    b->head = size | HEAP_FREE;
+    heap_link(heap, b);
+    BNEXT(b)->head |= HEAP_PREVFREE;
+}
+
+/**
+ * heap_largest - size of the largest allocation that would succeed now
+ *   param1[in]: pointer to the heap
+ *   return: bytes, 0 when the heap is full
+ */
+size_t
+heap_largest (heap_t* heap) {
+    hblock_t* b;
+    size_t max = 0;
+    signed char c;
+    if (!heap) return (0);
+    for (c = HEAP_BINS - 1; c >= 0 && !max; c--) {
+        for (b = heap->bin[c]; b; b = b->next) {
+            if (BSIZE(b) > max) {
+                max = BSIZE(b);
+            }
+        }
+    }
+    return (max ? max - HEAP_HEAD : 0);
+}
@@ -0,0 +1,53 @@
+#ifndef _HEAP_H_
+#define _HEAP_H_
+
+#include <stddef.h>
+
+/*    HEAP - Boundary tag allocator with segregated free lists
+ *    Every block starts with a size word, free blocks also end with one,
+ *    so both neighbours of a released block are found without walking
+ *    the heap. Free blocks are kept on one list per power of two size
+ *    class, a bitmap tells which lists are non-empty. Allocation takes
+ *    the head of the first non-empty class above the request, in at most
+ *    HEAP_BINS steps. Only if there's none, the own class of the request
+ *    is searched first fit, that's linear in the length of its list.
+ *    Release coalesces immediately, it's O(1).
+ */
+
+#define HEAP_BINS       (16)        /* size classes, one bit each */
+#define HEAP_ALIGN      (sizeof(void*) < 4 ? 4 : sizeof(void*))
+
+typedef struct hblock_s {
+    size_t              head;       /* block size | flags */
+    struct hblock_s*    next;       /* free blocks only */
+    struct hblock_s*    prev;
+} hblock_t;
+
+#define HEAP_ROUND(x)   (((x) + HEAP_ALIGN - 1) & ~(HEAP_ALIGN - 1))
+#define HEAP_HEAD       (sizeof(size_t))
+#define HEAP_MIN        HEAP_ROUND(sizeof(hblock_t) + sizeof(size_t))
+
+/* A region of len + HEAP_SLACK bytes holds a block of len bytes: the
+ * block takes len + HEAP_MIN at most, the sentinel and the rounding of
+ * the region the rest */
+#define HEAP_SLACK      (HEAP_MIN + HEAP_HEAD + (HEAP_ALIGN - 1))
+
+typedef struct heap_s {
+    char*               start;
+    char*               end;        /* sentinel block */
+    unsigned int        bitmap;     /* non-empty classes */
+    hblock_t*           bin[HEAP_BINS];
+    size_t              free;       /* free bytes, with headers */
+    size_t              low;        /* lowest free bytes seen */
+    unsigned int        fails;      /* allocations refused */
+} heap_t;
+
+/* Nothing is allocated */
+#define HEAP_EMPTY(h)   ((h)->free == (size_t)((h)->end - (h)->start))
+
+void        heap_init       (heap_t* heap, void* mem, size_t size);
+void*       heap_malloc     (heap_t* heap, size_t len);
+void        heap_free       (heap_t* heap, void* p);
+size_t      heap_largest    (heap_t* heap);
+
+#endif /* _HEAP_H_ */
@@ -0,0 +1,123 @@
+#include <stddef.h>
+#include <util/atomic.h>
+#include "pool.h"
+
+/*
+ *    POOL - Fixed-size object pool
+ */
+
+static pool_t*  pool_list;
+
+/**
+ * pool_init - set up a pool on a reserved buffer and register it
+ *   param1[in]: pointer to the pool
+ *   param2[in]: name of the pool, for statistics
+ *   param3[in]: buffer of num * size bytes
+ *   param4[in]: size of an object, at least the size of a pointer
+ *   param5[in]: number of objects
+ */
+void
+pool_init (pool_t* pool, const char* name,
+           void* mem, size_t size, unsigned int num) {
+    char* it = (char*)mem;
+    unsigned int i;
+    if (!pool) return;
+    pool->name = name;
+    pool->mem = (char*)mem;
+    pool->size = size;
+    pool->total = num;
+    pool->used = 0;
+    pool->peak = 0;
+    pool->fails = 0;
+    pool->free = NULL;
+    for (i = 0; mem && (size >= sizeof(void*)) && (i != num); i++) {
+        *(void**)it = pool->free;
+        pool->free = it;
+        it += size;
+    }
+    /* pools are set up by different tasks */
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        pool->next = pool_list;
+        pool_list = pool;
+    }
+    return;
+}
+
+/**
+ * pool_alloc - take an object from the pool
+ *   param1[in]: pointer to the pool
+ *   return:     pointer to the object, NULL if the pool is exhausted
+ */
+void*
+pool_alloc (pool_t* pool) {
+    void* obj;
+    if (!pool) return (NULL);
+    obj = pool->free;
+    if (!obj) {
+        pool->fails++;
+        return (NULL);
+    }
+    pool->free = *(void**)obj;
+    if (++(pool->used) > pool->peak) {
+        pool->peak = pool->used;
+    }
+    return (obj);
+}
+
+/**
+ * pool_free - give an object back to its pool
+ *   param1[in]: pointer to the pool
+ *   param2[in]: pointer to the object, NULL is ignored
+ */
+void
+pool_free (pool_t* pool, void* obj) {
+    if (!pool || !obj) return;
+    *(void**)obj = pool->free;
+    pool->free = obj;
+    pool->used--;
+    return;
+}
+
+/**
+ * pool_alloc_or - take an object from the pool, from elsewhere if it's
+ * exhausted
+ *   param1[in]: pointer to the pool
+ *   param2[in]: allocator for an object of the pool's size, or NULL
+ *   return:     pointer to the object, NULL if both are exhausted
+ */
+void*
+pool_alloc_or (pool_t* pool, void* (*fallback)(size_t)) {
+    void* obj = pool_alloc(pool);
+    if (!obj && pool && fallback) {
+        obj = fallback(pool->size);
+    }
+    return (obj);
+}
+
+/**
+ * pool_free_or - give an object back to the pool or where it came from
+ *   param1[in]: pointer to the pool
+ *   param2[in]: pointer to the object, NULL is ignored
+ *   param3[in]: release of the fallback allocator of pool_alloc_or()
+ */
+void
+pool_free_or (pool_t* pool, void* obj, void (*fallback)(void*)) {
+    if (!pool || !obj) return;
+    if (((char*)obj >= pool->mem) &&
+        ((char*)obj < pool->mem + pool->size * pool->total)) {
+        pool_free(pool, obj);
+    } else if (fallback) {
+        fallback(obj);
+    }
+    return;
+}
+
+/**
+ * pool_next - iterate through the registered pools
+ *   param1[in]: pointer to the previous pool, NULL for the first one
+ *   return:     pointer to the next pool, NULL at the end
+ */
+pool_t*
+pool_next (pool_t* pool) {
+    return (pool ? pool->next : pool_list);
+}
@@ -0,0 +1,51 @@
+#ifndef _POOL_H_
+#define _POOL_H_
+
+#include <stddef.h>
+
+/*    POOL - Fixed-size object pool
+ *    The objects are carved out of a buffer reserved up front, allocation
+ *    and release are O(1) and don't fragment the heap. Every pool is
+ *    registered for statistics, see pool_next().
+ */
+
+typedef struct pool_s {
+    struct pool_s*      next;       /* registered pools */
+    const char*         name;
+    char*               mem;        /* the reserved buffer */
+    void*               free;       /* free list, linked through objects */
+    size_t              size;       /* object size */
+    unsigned int        total;      /* capacity */
+    unsigned int        used;       /* objects in use */
+    unsigned int        peak;       /* highest number of objects in use */
+    unsigned int        fails;      /* allocations refused */
+} pool_t;
+
+void        pool_init   (pool_t* pool, const char* name,
+                         void* mem, size_t size, unsigned int num);
+void*       pool_alloc  (pool_t* pool);
+void        pool_free   (pool_t* pool, void* obj);
+void*       pool_alloc_or (pool_t* pool, void* (*fallback)(size_t));
+void        pool_free_or  (pool_t* pool, void* obj, void (*fallback)(void*));
+pool_t*     pool_next   (pool_t* pool);
+
+/* Pool with static storage for num objects of type */
+#define POOL_DEFINE(P, type, num)                                       \
+    static type     P##_mem[num];                                       \
+    static pool_t   P
+
+#define POOL_INIT(P, type)                                              \
+    pool_init(&(P), #P, (P##_mem), sizeof(type),                        \
+              sizeof(P##_mem) / sizeof(type))
+
+#define POOL_ALLOC(P, type)   ((type*)pool_alloc(&(P)))
+#define POOL_FREE(P, obj)     pool_free(&(P), (void*)(obj))
+
+/* The pool first, the fallback allocator (kmalloc) when it runs short.
+ * The free gives an object back to where it came from. */
+#define POOL_ALLOC_OR(P, type, fallback)                                \
+    ((type*)pool_alloc_or(&(P), (fallback)))
+#define POOL_FREE_OR(P, obj, fallback)                                  \
+    pool_free_or(&(P), (void*)(obj), (fallback))
+
+#endif /* _POOL_H_ */
@@ -79,6 +79,25 @@ q_remv (q_head_t *que, q_item_t* item) {
     return (item);
 }
 
+/**
+ * q_insert - put an item in front of another one
+ *   param1[in]: pointer to the queue
+ *   param2[in]: pointer to the item to insert before, NULL for the end
+ *   param3[in]: pointer to the item
+ *   return:     pointer to the item on success, NULL on error
+ */
+q_item_t*
+q_insert (q_head_t *que, q_item_t* pos, q_item_t* item) {
+    if (!item || !que) return (NULL);
+    if (!pos) return (q_end(que, item));
+    item->next = pos;
+    item->prev = pos->prev;
+    if (pos->prev) pos->prev->next = item;
+    else que->head = item;
+    pos->prev = item;
+    return (item);
+}
+
 /**
  * q_forall - iterate through the queue starting from the front to the end
  *     If callback function returns with a pointer to an item, iteration
@@ -23,11 +23,13 @@ void        q_init      (q_head_t *que);
 q_item_t*   q_front     (q_head_t *que, q_item_t* item);
 q_item_t*   q_end       (q_head_t *que, q_item_t* item);
 q_item_t*   q_remv      (q_head_t *que, q_item_t* item);
+q_item_t*   q_insert    (q_head_t *que, q_item_t* pos, q_item_t* item);
 q_item_t*   q_forall    (q_head_t *que, q_item_t*(*callback)(q_head_t*,q_item_t*));
 
 #define Q_FRONT(Q,I)    q_front((Q),(q_item_t*)(I))
 #define Q_END(Q,I)      q_end((Q),(q_item_t*)(I))
 #define Q_REMV(Q,I)     q_remv((Q),(q_item_t*)(I))
+#define Q_INSERT(Q,P,I) q_insert((Q),(q_item_t*)(P),(q_item_t*)(I))
 #define Q_FIRST(Q)      ((Q).head)
 #define Q_LAST(Q)       ((Q).tail)
 #define Q_NEXT(I)       (((q_item_t*)(I))->next)
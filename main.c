@@ -10,6 +10,7 @@
 #include "usr/init.h"
 #include "usr/apps.h"
 #include "usr/sh.h"
+#include "usr/bench.h"
 
 /*
  * The main purpose of this task is to start all the servers and set
@@ -62,12 +63,24 @@ startup (void* args UNUSED) {
     ex_regprg("mknod",      f_mknod,        DEFAULT_STACK_SIZE);
     ex_regprg("grep",       grep,           DEFAULT_STACK_SIZE);
     ex_regprg("fsdebug",    fs_debug,       DEFAULT_STACK_SIZE);
+    ex_regprg("top",        top,            DEFAULT_STACK_SIZE);
+    ex_regprg("stacks",     stacks,         DEFAULT_STACK_SIZE);
+    ex_regprg("ktrace",     ktrace_dump,    DEFAULT_STACK_SIZE);
+    ex_regprg("pools",      pools,          DEFAULT_STACK_SIZE);
+    ex_regprg("bench",      bench,          DEFAULT_STACK_SIZE);
     ex_regprg("init",       init,           DEFAULT_STACK_SIZE);
 
     /* starting process manager server */
-    initc = (char**)kmalloc(sizeof(char*[2])); /* Freed in PM */
+    initc = (char**)kmalloc(sizeof(char*[3])); /* Freed in PM */
+#ifdef BENCH
+    /* headless benchmark image, see 'make bench' */
+    initc[0] = "bench";
+    initc[1] = "2/0";
+#else
     initc[0] = "init";
     initc[1] = NULL;
+#endif
+    initc[2] = NULL;
     pid = createtask(TASK_PRIO_HIGH, PAGE_INVALID);
     allocatestack(pid, DEFAULT_STACK_SIZE * 2);
     setuptask(pid, pm, initc, NULL);
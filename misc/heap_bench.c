@@ -0,0 +1,178 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "malloc.h"
+#include "../lib/heap.h"
+
+/*
+ * Host side benchmark of the kernel heap (lib/heap.c) against the old
+ * greedy chunk list (misc/malloc.c)
+ *
+ *   $ gcc -O2 -o heap_bench misc/heap_bench.c misc/malloc.c lib/heap.c
+ *   $ ./heap_bench
+ *
+ * The trace mimics what the kernel sees while sh runs pipelines like
+ * 'cat f | grep x | xargs echo': per command a pm_task_t, an argument
+ * stack and a task stack, then the program's own pmmalloc() calls; the
+ * commands exit in arbitrary order, some background tasks live longer.
+ * Sizes are the AVR ones, headers are host sized, so the fragmentation
+ * figures are a bit pessimistic for both allocators.
+ */
+
+#define HEAP_SIZE       (3072)        /* tight, to see the failures */
+#define PIPELINES       (2000)
+#define ROUNDS          (50)
+#define SLOTS           (64)
+
+#define PM_TASK         (18)            /* sizeof(pm_task_t) */
+#define STACK           (160 + 39)      /* DEFAULT_STACK_SIZE + reserved */
+
+typedef struct {
+    const char* name;
+    void        (*init) (void);
+    void*       (*alloc) (size_t len);
+    void        (*release) (void* p);
+    size_t      (*largest) (void);
+} allocator_t;
+
+static char     mem[HEAP_SIZE] __attribute__ ((aligned (8)));
+static heap_t   heap;
+
+static void  h_init (void)           { heap_init(&heap, mem, sizeof(mem)); }
+static void* h_alloc (size_t len)    { return heap_malloc(&heap, len); }
+static void  h_release (void* p)     { heap_free(&heap, p); }
+static size_t h_largest (void)       { return heap_largest(&heap); }
+
+static void  g_init (void)           { chunklist_init((chunk_t*)mem, sizeof(mem)); }
+static void* g_alloc (size_t len)    { return do_malloc((chunk_t*)mem, len); }
+static void  g_release (void* p)     { do_free((chunk_t*)mem, p); }
+static size_t
+g_largest (void) {
+    chunk_t* it;
+    size_t max = 0;
+    for (it = (chunk_t*)mem; it; it = it->next) {
+        if (it->free && it->size > max) {
+            max = it->size;
+        }
+    }
+    return (max > sizeof(chunk_t) ? max - sizeof(chunk_t) : 0);
+}
+
+static const allocator_t allocators[] = {
+    { "greedy", g_init, g_alloc, g_release, g_largest },
+    { "heap",   h_init, h_alloc, h_release, h_largest },
+};
+
+typedef struct {
+    unsigned long   ops;
+    unsigned long   fails;
+    size_t          minlargest;
+} result_t;
+
+static unsigned long seed;
+
+static unsigned int
+rnd (unsigned int n) {
+    seed = seed * 1103515245UL + 12345UL;
+    return ((unsigned int)(seed >> 16) % n);
+}
+
+static void*
+take (const allocator_t* a, result_t* r, size_t len) {
+    void* p = a->alloc(len);
+    r->ops++;
+    if (!p) {
+        r->fails++;
+    }
+    return (p);
+}
+
+static void
+give (const allocator_t* a, result_t* r, void* p) {
+    if (p) {
+        a->release(p);
+        r->ops++;
+    }
+}
+
+static void
+run (const allocator_t* a, result_t* r) {
+    void* slot[SLOTS];
+    void* bg[4][3] = {{0}};
+    void* sh;
+    int n, i, k, cmds, line;
+    size_t largest;
+
+    memset(slot, 0, sizeof(slot));
+    a->init();
+    sh = take(a, r, STACK + 64);
+    for (n = 0; n != PIPELINES; n++) {
+        cmds = 1 + rnd(3);
+        /* sh forks the commands */
+        for (i = 0, k = 0; i != cmds; i++) {
+            slot[k++] = take(a, r, PM_TASK);
+            slot[k++] = take(a, r, 8 + rnd(32));        /* argv */
+            slot[k++] = take(a, r, STACK);
+            slot[k++] = take(a, r, 6);                  /* getopt */
+            switch (rnd(3)) {
+              case 0: slot[k++] = take(a, r, 256); break; /* xargs */
+              case 1:                                     /* grep */
+                for (line = rnd(8); line; line--) {
+                    give(a, r, take(a, r, 128));
+                }
+                break;
+              default: break;
+            }
+        }
+        /* they exit in any order */
+        for (i = k; i; i--) {
+            int j = rnd(i);
+            give(a, r, slot[j]);
+            slot[j] = slot[i - 1];
+        }
+        /* a background job now and then */
+        if (!rnd(16)) {
+            i = rnd(4);
+            for (k = 0; k != 3; k++) {
+                give(a, r, bg[i][k]);
+            }
+            bg[i][0] = take(a, r, PM_TASK);
+            bg[i][1] = take(a, r, 8 + rnd(32));
+            bg[i][2] = take(a, r, STACK);
+        }
+        largest = a->largest();
+        if (largest < r->minlargest) {
+            r->minlargest = largest;
+        }
+    }
+    for (i = 0; i != 4; i++) {
+        for (k = 0; k != 3; k++) {
+            give(a, r, bg[i][k]);
+        }
+    }
+    give(a, r, sh);
+}
+
+int main (void) {
+    unsigned int i, j;
+    clock_t t;
+    result_t r;
+
+    printf("%-8s %10s %8s %12s %10s\n",
+           "alloc", "ops", "fails", "min largest", "ns/op");
+    for (i = 0; i != sizeof(allocators) / sizeof(allocators[0]); i++) {
+        t = clock();
+        for (j = 0; j != ROUNDS; j++) {
+            memset(&r, 0, sizeof(r));
+            r.minlargest = HEAP_SIZE;
+            seed = 1;
+            run(&allocators[i], &r);
+        }
+        t = clock() - t;
+        printf("%-8s %10lu %8lu %12zu %10.1f\n", allocators[i].name,
+               r.ops, r.fails, r.minlargest,
+               (double)t * 1e9 / CLOCKS_PER_SEC / ((double)r.ops * ROUNDS));
+    }
+    return 0;
+}
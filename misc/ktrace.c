@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Host side decoder of the 'ktrace' dump
+ *
+ *   $ gcc -o ktrace misc/ktrace.c
+ *   $ ./ktrace < dump.txt
+ *
+ * Input lines: time type code task peer (hex, as printed by 'ktrace')
+ * Timer1 runs at 16 MHz / 1024, one count is 64 us. Timestamps are
+ * 16 bit, gaps longer than an overflow (cca. 4.2 s) can't be seen.
+ */
+
+#define US_PER_COUNT    64
+#define MAX_TASKS       64
+
+static unsigned int tasks[MAX_TASKS];
+static int ntasks;
+
+/* Tasks are numbered in the order of appearance */
+static int
+taskno (unsigned int pid) {
+    int i;
+    for (i = 0; i != ntasks; i++) {
+        if (tasks[i] == pid) {
+            return i;
+        }
+    }
+    if (ntasks == MAX_TASKS) {
+        return -1;
+    }
+    tasks[ntasks] = pid;
+    return ntasks++;
+}
+
+static const char*
+kcallname (unsigned int code) {
+    switch (code) {
+      case 0x00: return "yield";
+      case 0x01: return "getpid";
+      case 0x02: return "taskstat";
+      case 0x03: return "stackpeak";
+      case 0x05: return "ktrace";
+      case 0x06: return "taskdata";
+      case 0x07: return "settaskdata";
+      case 0x10: return "irqen";
+      case 0x11: return "irqdis";
+      case 0x20: return "createtask";
+      case 0x21: return "allocatestack";
+      case 0x22: return "setuptask";
+      case 0x23: return "starttask";
+      case 0x24: return "stoptask";
+      case 0x25: return "deletetask";
+      case 0x26: return "exittask";
+      case 0x30: return "malloc";
+      case 0x31: return "free";
+      case 0x40: return "send";
+      case 0x41: return "sendrec";
+      case 0x42: return "receive";
+      case 0x43: return "replyrecv";
+      case 0x44: return "sends";
+      case 0x45: return "sendrecs";
+      case 0x46: return "receives";
+      case 0x47: return "replyrecvs";
+      case 0x48: return "notify";
+      case 0x49: return "getnotify";
+      case 0x50: return "waitevent";
+    }
+    return "?";
+}
+
+static const char*
+eventname (unsigned int code) {
+    switch (code) {
+      case 0x01: return "TIMER1OVF";
+      case 0x02: return "USART0RX";
+      case 0x04: return "USART0TX";
+      case 0x08: return "USART1RX";
+      case 0x10: return "USART1TX";
+      case 0x20: return "TIMER1COMPA";
+    }
+    return "?";
+}
+
+static void
+printtask (unsigned int pid) {
+    if (pid == 0xFFFF) {
+        printf("%-6s", "ANY");
+    } else if (pid == 0xFFFE) {
+        printf("%-6s", "NOTIFY");
+    } else if (!pid) {
+        printf("%-6s", "-");
+    } else {
+        printf("T%-5d", taskno(pid));
+    }
+}
+
+int main (void) {
+    char line[128];
+    unsigned int time, code, task, peer;
+    unsigned int last = 0;
+    unsigned long long now = 0;
+    char type;
+    int first = 1;
+
+    printf("%12s %8s  %-6s %-6s %s\n", "time[us]", "delta", "task", "peer", "what");
+    while (fgets(line, sizeof(line), stdin)) {
+        if (sscanf(line, "%x %c %x %x %x", &time, &type, &code, &task, &peer) != 5) {
+            continue;   /* not a trace record */
+        }
+        if (!first) {
+            now += ((time - last) & 0xFFFF) * US_PER_COUNT;
+        }
+        printf("%12llu %8u  ", now,
+               first ? 0 : ((time - last) & 0xFFFF) * US_PER_COUNT);
+        first = 0;
+        last = time;
+        printtask(task);
+        printf(" ");
+        printtask(peer);
+        switch (type) {
+          case 'K':
+            printf(" kcall %s\n", kcallname(code));
+            break;
+          case 'E':
+            printf(" event %s%s\n", eventname(code), peer ? "" : " (no handler)");
+            break;
+          case 'M':
+            printf(" msg   %s\n", kcallname(code));
+            break;
+          default:
+            printf(" ?\n");
+            break;
+        }
+    }
+    printf("\ntasks:\n");
+    for (first = 0; first != ntasks; first++) {
+        printf(" T%d = 0x%x\n", first, tasks[first]);
+    }
+    return 0;
+}
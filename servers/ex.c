@@ -7,6 +7,8 @@ enum {
     EX_NONE,
     EX_REGPRG,
     EX_GETPRG,
+    EX_STACKPEAK,
+    EX_PRGINFO,
 };
 
 
@@ -32,12 +34,35 @@ typedef union getprg_u {
 } getprg_t;
 
 
-typedef struct ex_msg_s {
-    int             cmd;
-    union {
-        regprg_t        regprg;
-        getprg_t        getprg;
+typedef struct stackpeak_s {
+    int(*ptr)(char**);              /* prg entry */
+    size_t          peak;           /* stack used by a finished run */
+} stackpeak_t;
+
+
+typedef union prginfo_u {
+    struct {
+        int             idx;
+    } ask;
+    struct {
+        char*           name;       /* NULL: no more programs */
+        size_t          stack;
+        size_t          peak;
+    } ans;
+} prginfo_t;
+
+
+typedef union ex_msg_u {
+    struct {
+        int             cmd;
+        union {
+            regprg_t        regprg;
+            getprg_t        getprg;
+            stackpeak_t     stackpeak;
+            prginfo_t       prginfo;
+        };
     };
+    smsg_t          smsg;       /* travels in registers */
 } ex_msg_t;
 
 
@@ -45,6 +70,7 @@ typedef struct ex_prg_s {
     QUEUE_HEADER
     char* name;
     size_t stack;
+    size_t peak;                    /* highest stack usage seen */
     int(*ptr)(char**);
 } ex_prg_t;
 
@@ -66,6 +92,7 @@ ex_reg_prg (char* name, int(*ptr)(char**), size_t stack) {
     }
     prg->ptr = ptr;
     prg->stack = stack;
+    prg->peak = 0;
     prg->name = kmalloc(strlen(name)+1); // (string + 0)
     if(!prg->name){
         return NULL;
@@ -93,13 +120,41 @@ ex_get_prg (char* name, int(**ptr)(char**), size_t *stack) {
 }
 
 
+static void
+ex_stack_peak (int(*ptr)(char**), size_t peak) {
+    ex_prg_t* it;
+    for (it = (ex_prg_t*)Q_FIRST(ex_prg_head); it; it = (ex_prg_t*)Q_NEXT(it)) {
+        if ((it->ptr == ptr) && (it->peak < peak)) {
+            it->peak = peak;
+        }
+    }
+    return;
+}
+
+
+static void
+ex_prg_info (prginfo_t* info) {
+    int i = info->ask.idx;
+    ex_prg_t* it = (ex_prg_t*)Q_FIRST(ex_prg_head);
+    for (; it && i; i--) {
+        it = (ex_prg_t*)Q_NEXT(it);
+    }
+    info->ans.name = it ? it->name : NULL;
+    info->ans.stack = it ? it->stack : 0;
+    info->ans.peak = it ? it->peak : 0;
+    return;
+}
+
+
 void
 ex (void* args UNUSED) {
     pid_t msg_client;
+    pid_t replyto = NULL;
     ex_msg_t        msg;
     ex_init_prg();
     while(1){
-        msg_client = receive(TASK_ANY, &msg, sizeof(msg));
+        msg_client = replyrecvs(replyto, &(msg.smsg));
+        replyto = NULL;
         switch(msg.cmd){
           case EX_REGPRG:
             if(!ex_reg_prg(msg.regprg.name,
@@ -110,8 +165,14 @@ ex (void* args UNUSED) {
           case EX_GETPRG:
             ex_get_prg(msg.getprg.ask.name, &(msg.getprg.ans.ptr), &(msg.getprg.ans.stack));
             break;
+          case EX_STACKPEAK:
+            ex_stack_peak(msg.stackpeak.ptr, msg.stackpeak.peak);
+            continue;   /* no reply */
+          case EX_PRGINFO:
+            ex_prg_info(&(msg.prginfo));
+            break;
         }
-        send(msg_client, &msg);
+        replyto = msg_client;
     }
 }
 
@@ -135,7 +196,7 @@ ex_regprg (char* name, int(*ptr)(char**), size_t stack) {
     msg.regprg.name = name;
     msg.regprg.ptr = ptr;
     msg.regprg.stack = stack;
-    sendrec(extask, &msg, sizeof(msg));
+    sendrecs(extask, &(msg.smsg));
     return;
 }
 
@@ -148,9 +209,36 @@ ex_getprg (char* name, int(**ptr)(char**), size_t *stack) {
     ex_msg_t msg;
     msg.cmd = EX_GETPRG;
     msg.getprg.ask.name = name;
-    sendrec(extask, &msg, sizeof(msg));
+    sendrecs(extask, &(msg.smsg));
     *ptr = msg.getprg.ans.ptr;
     *stack = msg.getprg.ans.stack;
 }
 
+/*
+ * Stack usage of a finished run of the program at ptr
+ */
+
+void
+ex_stackpeak (int(*ptr)(char**), size_t peak) {
+    ex_msg_t msg;
+    msg.cmd = EX_STACKPEAK;
+    msg.stackpeak.ptr = ptr;
+    msg.stackpeak.peak = peak;
+    sends(extask, &(msg.smsg));
+    return;
+}
+
+/*
+ * Returns the name of the idx-th registered program, NULL past the last
+ */
 
+char*
+ex_prginfo (int idx, size_t *stack, size_t *peak) {
+    ex_msg_t msg;
+    msg.cmd = EX_PRGINFO;
+    msg.prginfo.ask.idx = idx;
+    sendrecs(extask, &(msg.smsg));
+    *stack = msg.prginfo.ans.stack;
+    *peak = msg.prginfo.ans.peak;
+    return (msg.prginfo.ans.name);
+}
@@ -10,4 +10,8 @@ void ex_regprg(char* name, int(*ptr)(char**), size_t stack);
 
 void ex_getprg(char* name, int(**ptr)(char**), size_t *stack);
 
+void ex_stackpeak(int(*ptr)(char**), size_t peak);
+
+char* ex_prginfo(int idx, size_t *stack, size_t *peak);
+
 #endif
@@ -14,6 +14,7 @@ typedef struct pm_task_s {
     };
     struct pm_task_s*   parent;
     char**              args;
+    int(*prg)(char**);             /* program running in the task */
 } pm_task_t;
 
 #define PM_PIDOF(p) ((p) ? ((p)->pid) : (NULL))
@@ -213,16 +214,20 @@ pm_findmyparent (q_head_t* que UNUSED, q_item_t* ptsk) {
 }
 
 /*
- *
+ * Arena: memory handed to a process in bulk, it's carved up by the
+ * process itself (see usr/lib/umalloc.c). The chunk header in front of
+ * it links it to the owner, it's reclaimed on exit.
  */
 typedef struct mem_chunk_s {
     QUEUE_HEADER
-    void*               ptr;
 } mem_chunk_t;
 
+#define PM_CHUNK(ptr)   ((mem_chunk_t*)(ptr) - 1)
+
 
 /*
- *
+ * Returns the chunk of an arena of the task, NULL if it doesn't own one
+ * at ptr. Compares addresses only, a foreign pointer isn't dereferenced.
  */
 static mem_chunk_t*
 findchunk (pm_task_t* ptsk, void* ptr) {
@@ -232,7 +237,7 @@ findchunk (pm_task_t* ptsk, void* ptr) {
     }
     it = (mem_chunk_t*) Q_FIRST(ptsk->chunk_q);
     while (it) {
-        if (it->ptr == ptr) {
+        if (it == PM_CHUNK(ptr)) {
             break;
         }
         it = (mem_chunk_t*) Q_NEXT(it);
@@ -245,9 +250,6 @@ findchunk (pm_task_t* ptsk, void* ptr) {
  */
 static q_item_t*
 pm_delchunks (q_head_t* que, q_item_t* chunk) {
-    if (((mem_chunk_t*)chunk)->ptr) {
-        kfree(((mem_chunk_t*)chunk)->ptr);
-    }
     kfree(Q_REMV(que, chunk));
     return NULL;
 }
@@ -259,19 +261,13 @@ pm_delchunks (q_head_t* que, q_item_t* chunk) {
 void
 do_pmalloc (pmmsg_t* msg) {
 
-    mem_chunk_t *chunk = (mem_chunk_t*) kmalloc(sizeof(mem_chunk_t));
+    mem_chunk_t *chunk = kmalloc(sizeof(mem_chunk_t) + msg->malloc.ask.size);
     if (!chunk) {
         msg->malloc.ans.ptr = NULL;
         return;
     }
-    chunk->ptr = kmalloc(msg->malloc.ask.size);
-    if (!chunk->ptr) {
-        kfree(chunk);
-        msg->malloc.ans.ptr = NULL;
-        return;
-    }
     Q_FRONT(&(PM_CLIENT->chunk_q), chunk);
-    msg->malloc.ans.ptr = chunk->ptr;
+    msg->malloc.ans.ptr = chunk + 1;
     return;
 }
 
@@ -281,10 +277,9 @@ do_pmalloc (pmmsg_t* msg) {
 void
 do_pmfree (pmmsg_t* msg) {
     mem_chunk_t* chunk = findchunk(PM_CLIENT, msg->free.ptr);
-    if (chunk && chunk->ptr) {
-        kfree (chunk->ptr);
+    if (chunk) {
+        kfree(Q_REMV(&(PM_CLIENT->chunk_q), chunk));
     }
-    kfree(Q_REMV(&(PM_CLIENT->chunk_q), chunk));
     return;
 }
 
@@ -330,6 +325,17 @@ cook_argstack (char* bottom, char* orgargv[]) {
     newargv[i] = NULL;
 }
 
+/*
+ * Tell ex how deep the program of the task went in its stack
+ */
+static void
+pm_reportstack (pm_task_t* ptsk) {
+    if (ptsk->prg) {
+        ex_stackpeak(ptsk->prg, stackpeak(PM_PIDOF(ptsk)));
+    }
+    return;
+}
+
 /*
  *
  */
@@ -348,13 +354,16 @@ pm_setuptask (pm_task_t* ptsk,
     }
     cook_argstack((char*)newargs, argv);
     /* all data is saved, we can free the old data */
+    pm_reportstack(ptsk);
     stoptask(PM_PIDOF(ptsk));
     q_forall(&(ptsk->chunk_q), pm_delchunks);
+    settaskdata(PM_PIDOF(ptsk), NULL);  /* arenas are gone */
     if (ptsk->args) {
         kfree(ptsk->args);
         ptsk->args = NULL;
     }
     ptsk->args = newargs;
+    ptsk->prg = ptr;
 
     allocatestack(PM_PIDOF(ptsk), stacksize);
 
@@ -459,6 +468,7 @@ do_exit (pmmsg_t* msg, pid_t* replyto) {
     pm_task_t*  pm_task;
 
     q_forall(&(PM_CLIENT->chunk_q), pm_delchunks);
+    pm_reportstack(PM_CLIENT);
     stoptask(PM_PIDOF(PM_CLIENT));
     deletetask(PM_PIDOF(PM_CLIENT));
     vfs_deletetask(PM_CLIENT->pid);
@@ -532,6 +542,7 @@ do_wait (pmmsg_t* msg) {
 void
 pm (void* args) {
     pid_t msg_client;
+    pid_t replyto = NULL;
     pmmsg_t msg;
 
     q_init(&task_q);
@@ -544,7 +555,8 @@ pm (void* args) {
     kfree(args);
 
     while (1) {
-        msg_client = receive(TASK_ANY, &msg, sizeof(msg));
+        msg_client = replyrecv(replyto, &msg, sizeof(msg));
+        replyto = NULL;
         Q_FRONT(&task_q, Q_REMV(&task_q, pm_findbypid(msg_client)));
 
         switch(msg.cmd){
@@ -582,7 +594,7 @@ pm (void* args) {
           default:
             continue;
         }
-        send(msg_client, &msg);
+        replyto = msg_client;
     }
 }
 
@@ -614,12 +626,25 @@ spawntask (int(*ptsk)(char**), size_t stacksize, char** argv) {
     return (msg.spawn.ans.pid);
 }
 
+/*
+ * One hook for all processes, it finds the process's own state itself
+ */
+static void (*pm_atexit)(void);
+
+void
+pmatexit (void (*fn)(void)) {
+    pm_atexit = fn;
+}
+
 /*
  * Execute
  */
 int
 execv (char* name, char** argv) {
     pmmsg_t msg;
+    if (pm_atexit) {
+        pm_atexit();
+    }
     msg.cmd = PM_EXEC;
     msg.exec.ask.name = name;
     msg.exec.ask.argv = argv;
@@ -633,6 +658,9 @@ execv (char* name, char** argv) {
 void
 mexit (int code) {
     pmmsg_t msg;
+    if (pm_atexit) {
+        pm_atexit();
+    }
     msg.cmd = PM_EXIT;
     msg.exit.code = code;
     sendrec(pmtask, &msg, sizeof(msg));
@@ -671,10 +699,10 @@ waitpid (pid_t p, int* code) {
 }
 
 /*
- *
+ * Arena of at least size bytes, freed at exit at the latest
  */
 void*
-pmmalloc (size_t size) {
+pmarena (size_t size) {
     pmmsg_t msg;
     msg.cmd = PM_MALLOC;
     msg.malloc.ask.size = size;
@@ -686,7 +714,7 @@ pmmalloc (size_t size) {
  *
  */
 void
-pmfree (void* ptr) {
+pmarenafree (void* ptr) {
     pmmsg_t msg;
     msg.cmd = PM_FREE;
     msg.free.ptr = ptr;
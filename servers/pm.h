@@ -26,9 +26,13 @@ pid_t waitpid (pid_t p, int* code);
 
 void mexit (int code);
 
-void* pmmalloc (size_t size);
+/* Called by mexit() and execv() first, the user libraries flush here */
+void pmatexit (void (*fn)(void));
 
-void pmfree (void* ptr);
+/* Memory in bulk for the process allocator, see usr/lib/umalloc.h */
+void* pmarena (size_t size);
+
+void pmarenafree (void* ptr);
 
 int argc (char** argv);
 
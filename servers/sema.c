@@ -1,6 +1,7 @@
 #include "kernel.h"
 #include "sema.h"
 #include "queue.h"
+#include "pool.h"
 /*
  *
  */
@@ -10,6 +11,10 @@ typedef struct client_s {
     pid_t pid;
 } client_t;
 
+#define SEMA_CLIENT_MAX     (8)
+
+POOL_DEFINE(client_pool, client_t, SEMA_CLIENT_MAX);
+
 /*
  *
  */
@@ -80,7 +85,7 @@ addclient (sema_t* s, pid_t pid) {
     if (!s || !pid) {
         return NULL;
     }
-    cli = (client_t*) kmalloc(sizeof(client_t));
+    cli = POOL_ALLOC(client_pool, client_t);
     if (!cli) {
         return NULL;
     }
@@ -112,7 +117,7 @@ removeclient (sema_t* s, pid_t pid) {
     if (cli->pid != pid) {
         return NULL;
     }
-    kfree(Q_REMV(&(s->client_q), cli));
+    POOL_FREE(client_pool, Q_REMV(&(s->client_q), cli));
     return (cli);
 }
 
@@ -159,10 +164,13 @@ typedef enum {
  *
  */
 
-typedef struct semamsg_s {
-    sema_t*        sema;
-    sema_cmd       cmd;
-    unsigned int   val;
+typedef union semamsg_u {
+    struct {
+        sema_t*        sema;
+        sema_cmd       cmd;
+        unsigned int   val;
+    };
+    smsg_t         smsg;        /* travels in registers */
 } semamsg_t;
 
 /*
@@ -172,13 +180,16 @@ typedef struct semamsg_s {
 void
 semasrv (void* args UNUSED) {
     pid_t client;
+    pid_t replyto = NULL;
     semamsg_t msg;
     /* Do some cleanup before start */
     q_init(&(sema_q));
+    POOL_INIT(client_pool, client_t);
     /* Let's go! */
 
     while (1) {
-        client = receive(TASK_ANY, &msg, sizeof(msg));
+        client = replyrecvs(replyto, &(msg.smsg));
+        replyto = NULL;
         switch(msg.cmd){
 
           case SEMA_CREATE:
@@ -214,7 +225,7 @@ semasrv (void* args UNUSED) {
           default:
             continue;
         }
-        send(client, &msg);
+        replyto = client;
     }
 }
 
@@ -243,7 +254,7 @@ createsema (unsigned int val) {
     semamsg_t msg;
     msg.cmd = SEMA_CREATE;
     msg.val = val;
-    sendrec(sematask, &msg, sizeof(msg));
+    sendrecs(sematask, &(msg.smsg));
     return msg.sema;
 }
 
@@ -256,7 +267,7 @@ deletesema (sema s) {
     semamsg_t msg;
     msg.cmd = SEMA_DELETE;
     msg.sema = s;
-    sendrec(sematask, &msg, sizeof(msg));
+    sendrecs(sematask, &(msg.smsg));
     return;
 }
 
@@ -269,7 +280,7 @@ waitsema (sema s) {
     semamsg_t msg;
     msg.cmd = SEMA_WAIT;
     msg.sema = s;
-    sendrec(sematask, &msg, sizeof(msg));
+    sendrecs(sematask, &(msg.smsg));
     return;
 }
 
@@ -282,7 +293,7 @@ signalsema (sema s) {
     semamsg_t msg;
     msg.cmd = SEMA_SIGNAL;
     msg.sema = s;
-    send(sematask, &msg);
+    sends(sematask, &(msg.smsg));
     return;
 }
 
@@ -295,7 +306,7 @@ getsema (sema s) {
     semamsg_t msg;
     msg.cmd = SEMA_GET;
     msg.sema = s;
-    sendrec(sematask, &msg, sizeof(msg));
+    sendrecs(sematask, &(msg.smsg));
     return msg.val;
 }
 
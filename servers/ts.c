@@ -1,17 +1,38 @@
 #include <avr/io.h> /* timer */
 #include "../kernel/kernel.h"
 #include "../lib/queue.h"
+#include "../lib/pool.h"
 #include "ts.h"
 
 /*
- *
+ * Sleeping task. Waiters are kept sorted by deadline, a wake-up only
+ * touches the expired ones at the front.
  */
 typedef struct tswait_s {
     QUEUE_HEADER
     pid_t           client;
-    int             delay;
+    unsigned long   deadline;       /* in timer counts */
 } tswait_t;
 
+/*
+ * Timer1 runs free at 16 MHz / 1024. A tick is 512 counts, the same
+ * cca. 30 Hz as the old overflow tick, so the counter overflows only
+ * every 128 ticks. Compare match A is programmed for the nearest
+ * deadline, there's no periodic tick.
+ */
+#define TS_COUNTS_PER_SEC   (15625UL)
+#define TS_COUNTS_PER_TICK  (512UL)
+
+static volatile unsigned int    ts_epoch;   /* overflows, kept by tickd */
+
+/*
+ * Preallocated wait records, delay() never touches the heap. A client
+ * waits in delay() for the reply, so it holds one record at most.
+ */
+#define TS_WAIT_MAX         (TASK_MAX)
+
+POOL_DEFINE(tswait_pool, tswait_t, TS_WAIT_MAX);
+
 /*
  * TIMER COMMANDS
  */
@@ -25,6 +46,11 @@ enum {
     TS_EXIT,
 };
 
+/*
+ * Notification bits
+ */
+#define TS_NOTIFY_TIMER     (0x0001)    /* overflow or deadline */
+
 /*
  * DELAY
  */
@@ -33,46 +59,89 @@ typedef struct delay_s {
 } delay_t;
 
 /*
- *
+ * Short message, travels in registers
  */
-typedef struct tsmsg_s {
-    int             cmd;
-    union {
-        delay_t         delay;          /* delay */
-        time_t          uptime;         /* uptime */
-        time_t          globtime;       /* global time */
+typedef union tsmsg_u {
+    struct {
+        int             cmd;
+        union {
+            delay_t         delay;          /* delay */
+            time_t          uptime;         /* uptime */
+            time_t          globtime;       /* global time */
+        };
     };
+    smsg_t          smsg;
 } tsmsg_t;
 
 
 /*
- * Returns the created timer, or NULL on error
+ * Returns the created timer, or NULL if the pool is exhausted
  */
 static tswait_t*
-addtswait (pid_t client, int delay, q_head_t* que) {
+addtswait (pid_t client, unsigned long deadline, q_head_t* que) {
     tswait_t *t;
-    t = (tswait_t*) kmalloc(sizeof(tswait_t));
+    tswait_t *it;
+    t = POOL_ALLOC(tswait_pool, tswait_t);
     if (!t) {
         return NULL;
     }
     t->client = client;
-    t->delay = delay;
-    Q_END(que, t);
+    t->deadline = deadline;
+    /* new deadlines tend to be the latest, search from the end */
+    for (it = (tswait_t*)Q_LAST(*que); it; it = (tswait_t*)Q_PREV(it)) {
+        if ((long)(deadline - it->deadline) >= 0) {
+            break;
+        }
+    }
+    Q_INSERT(que, it ? Q_NEXT(it) : Q_FIRST(*que), t);
     return (t);
 }
 
 /*
- *
+ * Current time in timer counts. ts runs with interrupts disabled, an
+ * overflow not yet seen by tickd is still pending in TOV1.
  */
-static q_item_t*
-ts_managedelay (q_head_t* que, q_item_t* w) {
-    tsmsg_t        msg;
-    if (--(((tswait_t*)w)->delay)) {
-        return (NULL);
+static unsigned long
+ts_now (void) {
+    unsigned int epoch = ts_epoch;
+    unsigned int cnt = TCNT1;
+    if (TIFR1 & (1 << TOV1)) {
+        cnt = TCNT1;
+        epoch++;
+    }
+    return ((((unsigned long)epoch) << 16) | cnt);
+}
+
+/*
+ * Unlock the waiters whose deadline has passed, then arm compare match A
+ * for the nearest one, unless the next overflow comes first. The counter
+ * runs on meanwhile: if the deadline is due by the time the match is
+ * armed, it may have been missed, expire again.
+ */
+static void
+ts_expire (q_head_t* que, unsigned long now) {
+    tsmsg_t         msg;
+    tswait_t*       nearest;
+
+    while (1) {
+        TIMSK1 &= (~(1 << OCIE1A));
+        while ((nearest = (tswait_t*)Q_FIRST(*que)) &&
+               ((long)(nearest->deadline - now) <= 0)) {
+            sends(nearest->client, &(msg.smsg)); /* unlock waiting tasks */
+            POOL_FREE(tswait_pool, Q_REMV(que, nearest));
+        }
+        if (!nearest ||
+            ((nearest->deadline - (now & 0xFFFF0000UL)) > 0xFFFFUL)) {
+            return;
+        }
+        OCR1A = (unsigned int)(nearest->deadline);
+        TIFR1 = (1 << OCF1A);       /* clear a stale match */
+        TIMSK1 |= (1 << OCIE1A);
+        now = ts_now();
+        if ((long)(nearest->deadline - now) > 0) {
+            return;
+        }
     }
-    send(((tswait_t*)w)->client, &msg); /* unlock waiting tasks */
-    kfree(Q_REMV(que, w));
-    return (NULL);
 }
 
 /*
@@ -80,19 +149,21 @@ ts_managedelay (q_head_t* que, q_item_t* w) {
  */
 static void
 tickd (void* args UNUSED) {
-    tsmsg_t msg;
-    msg.cmd = TS_NONE;
     pid_t tserver = receive(TASK_ANY, NULL, 0);
     kirqdis();
-    TCCR1B |= (1 << CS11);      /* set cca. 30 Hz */
-
-    while (msg.cmd != TS_EXIT) {
-        TIMSK1 |= (1 << TOIE1);     /* enable TIMER1OVF interrupt */
-        waitevent(EVENT_TIMER1OVF | PREEMPT_ON_EVENT);
-        TIFR1 |= (1 << TOV1);     /* clear overflow bit */
-        TIMSK1 &= (~(1 << TOIE1));     /* disable TIMER1OVF interrupt */
-        msg.cmd = TS_TICK;
-        sendrec(tserver, &msg, sizeof(tsmsg_t));
+    ts_epoch = 0;
+    TCNT1 = 0;
+    TCCR1B |= (1 << CS12) | (1 << CS10);    /* free running, clk/1024 */
+    TIMSK1 |= (1 << TOIE1);     /* enable TIMER1OVF interrupt */
+
+    while (1) {
+        if (waitevent(EVENT_TIMER1OVF | EVENT_TIMER1COMPA | PREEMPT_ON_EVENT)
+            == EVENT_TIMER1OVF) {
+            ts_epoch++;
+        } else {
+            TIMSK1 &= (~(1 << OCIE1A));     /* compare match is one shot */
+        }
+        notify(tserver, TS_NOTIFY_TIMER);
     }
 }
 
@@ -116,17 +187,20 @@ step_timer (time_t* time) {
 void
 ts (void* args UNUSED) {
     pid_t           client;
+    pid_t           replyto = NULL;
     tsmsg_t        msg;
     q_head_t        ts_wait_q;
     time_t          uptime;
     time_t          globtime;
-    char            ticks;
+    unsigned long   now;
+    unsigned long   clockstamp;     /* counts at the last second */
 
     kirqdis();
     memset (&uptime, 0, sizeof(time_t));
     memset (&globtime, 0, sizeof(time_t));
-    ticks = 0;
+    clockstamp = 0;
     q_init(&ts_wait_q);
+    POOL_INIT(tswait_pool, tswait_t);
 
     client = createtask(TASK_PRIO_RT, PAGE_INVALID);
     allocatestack(client, DEFAULT_STACK_SIZE - 64);
@@ -136,26 +210,41 @@ ts (void* args UNUSED) {
     send(client, NULL);
 
     while (1) {
-        client = receive(TASK_ANY, &msg, sizeof(msg));
+        client = replyrecvs(replyto, &(msg.smsg));
+        replyto = NULL;
+        if (client == TASK_NOTIFY) {
+            getnotify();
+            msg.cmd = TS_TICK;
+        }
+        /* maintain uptime counter, at least once per overflow */
+        now = ts_now();
+        while ((now - clockstamp) >= TS_COUNTS_PER_SEC) {
+            clockstamp += TS_COUNTS_PER_SEC;
+            step_timer(&uptime);
+            step_timer(&globtime);
+        }
         switch (msg.cmd) {
 
           case TS_DELAY:
-            if (msg.delay.ticks) {
-                addtswait(client, msg.delay.ticks, &ts_wait_q);
+            if (msg.delay.ticks > 0) {
+                tswait_t* t = addtswait(client,
+                                        now + msg.delay.ticks * TS_COUNTS_PER_TICK,
+                                        &ts_wait_q);
+                if (!t) {
+                    break;      /* can't be, one record per task */
+                }
+                if (t == (tswait_t*)Q_FIRST(ts_wait_q)) {
+                    /* new nearest deadline */
+                    ts_expire(&ts_wait_q, now);
+                }
                 continue;
             }
             break;
 
           case TS_TICK:
-            /* maintain uptime counter */
-            if(++ticks == 30) {
-                ticks = 0;
-                step_timer(&uptime);
-                step_timer(&globtime);
-            }
             /* maintain waiting tasks */
-            q_forall(&ts_wait_q, ts_managedelay);
-            break;
+            ts_expire(&ts_wait_q, now);
+            continue;   /* tickd doesn't wait for reply */
 
           case TS_GET_UPTIME:
             memcpy(&(msg.uptime), &uptime, sizeof(time_t));
@@ -170,7 +259,7 @@ ts (void* args UNUSED) {
             break;
 
         }
-        send(client, &msg);
+        replyto = client;
     }
 }
 
@@ -196,7 +285,7 @@ delay (int ticks) {
     tsmsg_t msg;
     msg.cmd = TS_DELAY;
     msg.delay.ticks = ticks;
-    sendrec(tstask, &msg, sizeof(msg));
+    sendrecs(tstask, &(msg.smsg));
     return;
 }
 
@@ -207,7 +296,7 @@ void
 getuptime (time_t* time) {
     tsmsg_t msg;
     msg.cmd = TS_GET_UPTIME;
-    sendrec(tstask, &msg, sizeof(msg));
+    sendrecs(tstask, &(msg.smsg));
     memcpy(time, &(msg.uptime), sizeof(time_t));
     return;
 }
@@ -219,7 +308,7 @@ void
 gettime (time_t* time) {
     tsmsg_t msg;
     msg.cmd = TS_GET_GLOBTIME;
-    sendrec(tstask, &msg, sizeof(msg));
+    sendrecs(tstask, &(msg.smsg));
     memcpy(time, &(msg.globtime), sizeof(time_t));
     return;
 }
@@ -232,7 +321,7 @@ settime (time_t* time) {
     tsmsg_t msg;
     msg.cmd = TS_SET_GLOBTIME;
     memcpy(&(msg.uptime), time, sizeof(time_t));
-    sendrec(tstask, &msg, sizeof(msg));
+    sendrecs(tstask, &(msg.smsg));
     return;
 }
 
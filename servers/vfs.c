@@ -1,5 +1,6 @@
 #include "../kernel/kernel.h"
 #include "../lib/queue.h"
+#include "../lib/pool.h"
 #include "../lib/mstddef.h"
 #include "vfs.h"
 #include "../drivers/drv.h"
@@ -29,11 +30,15 @@ static filp_t           filp[MAX_FILP];
 
 /*
  *  TASK
+ *
+ *  Every process gets a slot in vfs_addnewtask. The pid of a message is
+ *  resolved through an open addressing hash of pids to slots, the cost
+ *  doesn't grow with the number of processes.
  */
 
 typedef struct vfs_task_s {
-    QUEUE_HEADER
     pid_t               pid;
+    unsigned char       slot;
     int                 fd[MAX_FD];
     int                 wdev;   /* working dir */
     int                 wino;
@@ -41,7 +46,337 @@ typedef struct vfs_task_s {
     int                 rino;
 } vfs_task_t;
 
-static q_head_t         vfs_task_q;
+#define VFS_SLOTS       (24)    /* as many as the kernel has tasks */
+#define VFS_HASH        (32)    /* power of 2, above VFS_SLOTS */
+#define VFS_HASHOF(pid) ((unsigned char)(((size_t)(pid) ^                 \
+                                          ((size_t)(pid) >> 4) ^          \
+                                          ((size_t)(pid) >> 8)) &         \
+                                         (VFS_HASH - 1)))
+
+static vfs_task_t*      vfs_slot[VFS_SLOTS];
+static unsigned char    vfs_hash[VFS_HASH];    /* slot + 1, 0: empty */
+
+/*
+ *  REQUESTS
+ *
+ *  Reads, writes and releases wait in a queue per device, a driver has
+ *  at most one of them at a time. It is sent with send(), the driver's
+ *  answer comes back as a message of its own and the VFS serves other
+ *  clients and devices meanwhile. The answer to a client request is
+ *  matched by the tag of its table entry: a held request stays in the
+ *  table until a VFS_REPEAT or VFS_FINAL carries its tag back.
+ *  The rare calls (open, pipe, mknod, lookups) are synchronous, see
+ *  vfs_call(). Messages of the VFS that aren't in the table carry
+ *  VFS_NOTAG, VFS_DIRECT marks the ones clients send through a channel.
+ */
+
+/*
+ * A client waits for the answer to its read or write, so TASK_MAX entries
+ * are kept for those and a read or write always gets one. Poll rounds and
+ * node releases take the spare ones, they have a way out if there's none.
+ */
+#define VFS_REQ_SPARE   (8)
+#define VFS_REQ_MAX     (TASK_MAX + VFS_REQ_SPARE)
+
+typedef struct vfs_req_s {
+    QUEUE_HEADER
+    vfsmsg_t            msg;
+    int                 fp;     /* filp of a read/write, -1 */
+} vfs_req_t;
+
+POOL_DEFINE(vfs_req, vfs_req_t, VFS_REQ_MAX);
+
+#define VFS_TAG(req)    ((unsigned char)((req) - vfs_req_mem))
+#define VFS_NOTAG       (VFS_REQ_MAX)
+
+#define VFS_IRQ_RD      (0x01)
+#define VFS_IRQ_WR      (0x02)
+
+typedef struct vfs_dev_s {
+    q_head_t            req_q;  /* waiting for the driver */
+    vfs_req_t*          cur;    /* with the driver and nobody waits */
+    char                busy;   /* the driver has a job */
+    char                irq;    /* interrupts not forwarded yet */
+} vfs_dev_t;
+
+static vfs_dev_t        vfs_dev[MAX_DEV];
+
+static vfs_req_t*
+vfs_req_spare (void) {
+    if ((vfs_req.total - vfs_req.used) <= TASK_MAX) {
+        return (NULL);
+    }
+    return (POOL_ALLOC(vfs_req, vfs_req_t));
+}
+
+static void
+vfs_req_free (vfs_req_t* req) {
+    req->msg.client = NULL;     /* the tag is stale from now */
+    POOL_FREE(vfs_req, req);
+}
+
+/*
+ * Gives the driver its next job if it is free, interrupts first
+ */
+static void
+vfs_kick (int dev) {
+    vfs_dev_t*  d = &vfs_dev[dev];
+    vfs_req_t*  req;
+    vfsmsg_t    msg;
+
+    if (d->busy || !devtab[dev]) {
+        return;
+    }
+    if (d->irq) {
+        msg.cmd = (d->irq & VFS_IRQ_RD) ? VFS_RD_INTERRUPT : VFS_WR_INTERRUPT;
+        d->irq &= (d->irq & VFS_IRQ_RD) ? ~VFS_IRQ_RD : ~VFS_IRQ_WR;
+        msg.client = NULL;
+        msg.tag = VFS_NOTAG;
+        d->cur = NULL;
+        d->busy = 1;
+        send(devtab[dev], &msg);
+        return;
+    }
+    req = (vfs_req_t*)Q_FIRST(d->req_q);
+    if (!req) {
+        return;
+    }
+    Q_REMV(&(d->req_q), req);
+    if (req->fp >= 0) {
+        req->msg.rw.pos = filp[req->fp].pos;    /* after the previous one */
+    }
+    d->cur = req->msg.client ? NULL : req;
+    d->busy = 1;
+    send(devtab[dev], &(req->msg));
+}
+
+static void
+vfs_queue (int dev, vfs_req_t* req) {
+    req->msg.tag = VFS_TAG(req);
+    Q_END(&(vfs_dev[dev].req_q), req);
+    vfs_kick(dev);
+}
+
+static void vfs_polled (vfs_req_t* req, vfsmsg_t *msg);
+
+/*
+ * The answer to a request: its client gets it, the filp moves on
+ */
+static void
+vfs_complete (vfsmsg_t *msg) {
+    vfs_req_t* req;
+
+    msg->cmd = VFS_FINAL;
+    if (!msg->client || (msg->tag >= VFS_NOTAG)) {
+        return;     /* nobody waits */
+    }
+    req = &vfs_req_mem[msg->tag];
+    if (req->msg.client != msg->client) {
+        return;     /* not a request of the table */
+    }
+    if (req->msg.cmd == VFS_POLL) {
+        vfs_polled(req, msg);
+        return;
+    }
+    if (req->fp >= 0) {
+        filp[req->fp].pos += msg->rw.bnum;
+    }
+    send(msg->client, msg);
+    vfs_req_free(req);
+}
+
+/*
+ * A message of a busy driver. VFS_REPEAT answers a held request and the
+ * driver waits for a reply (returned). VFS_HOLD ends its job, anything
+ * else ends it with an answer.
+ */
+static pid_t
+vfs_driver (int dev, vfsmsg_t *msg) {
+    vfs_dev_t*  d = &vfs_dev[dev];
+    int         cmd = msg->cmd;
+
+    if (cmd != VFS_HOLD) {
+        vfs_complete(msg);
+    }
+    if (cmd == VFS_REPEAT) {
+        return (devtab[dev]);
+    }
+    if (d->cur) {
+        vfs_req_free(d->cur);
+    }
+    d->cur = NULL;
+    d->busy = 0;
+    return (NULL);
+}
+
+/*
+ * Synchronous call, the job the driver has is finished first
+ */
+static void
+vfs_call (int dev, vfsmsg_t *msg) {
+    vfsmsg_t    m;
+    pid_t       replyto;
+
+    while (vfs_dev[dev].busy) {
+        receive(devtab[dev], &m, sizeof(m));
+        if ((replyto = vfs_driver(dev, &m))) {
+            send(replyto, &m);
+        }
+    }
+    msg->tag = VFS_NOTAG;
+    sendrec(devtab[dev], msg, sizeof(vfsmsg_t));
+    while (msg->cmd == VFS_REPEAT) {
+        vfs_complete(msg);
+        sendrec(devtab[dev], msg, sizeof(vfsmsg_t));
+    }
+    vfs_kick(dev);
+}
+
+/*
+ *  POLL
+ *
+ *  A client waiting in poll() is held like one waiting for a driver. In
+ *  a round, every fd is asked for through the request table, ready or
+ *  not, and the client is answered when all drivers have: if something
+ *  is ready or it doesn't wait. Otherwise the drivers have noted the
+ *  interest, a driver notifies the VFS when a node someone waits on
+ *  changes (the tty with its interrupts anyway) and a new round starts.
+ */
+
+#define VFS_POLLERS     (4)
+
+typedef struct vfs_poller_s {
+    pid_t               client; /* NULL: free */
+    vfs_task_t*         task;
+    struct pollfd*      fds;
+    int                 n;
+    char                wait;
+    char                pending;    /* fds with the drivers */
+    char                again;      /* a device changed in the round */
+    unsigned char       devs;       /* devtab slots of the fds */
+} vfs_poller_t;
+
+static vfs_poller_t     vfs_poller[VFS_POLLERS];
+
+static void vfs_poll_round (vfs_poller_t* p);
+
+static void
+vfs_poll_reply (vfs_poller_t* p, int n) {
+    vfsmsg_t msg;
+    msg.cmd = VFS_FINAL;
+    msg.poll.n = n;
+    send(p->client, &msg);
+    p->client = NULL;
+}
+
+static int
+vfs_poll_ready (vfs_poller_t* p) {
+    int i;
+    int n = 0;
+    for (i = 0; i != p->n; i++) {
+        if (p->fds[i].revents) {
+            n++;
+        }
+    }
+    return (n);
+}
+
+/*
+ * All the drivers have answered
+ */
+static void
+vfs_poll_end (vfs_poller_t* p) {
+    int n = vfs_poll_ready(p);
+    if (n || !p->wait) {
+        vfs_poll_reply(p, n);
+    } else if (p->again) {
+        vfs_poll_round(p);
+    }
+    return;
+}
+
+static void
+vfs_poll_round (vfs_poller_t* p) {
+    vfs_task_t* client = p->task;
+    vfs_req_t*  req;
+    int         fp;
+    int         i;
+
+    p->again = 0;
+    p->devs = 0;
+    for (i = 0; i != p->n; i++) {
+        p->fds[i].revents = 0;
+        if ((p->fds[i].fd < 0) || (p->fds[i].fd >= MAX_FD) ||
+            ((fp = client->fd[p->fds[i].fd]) < 0)) {
+            p->fds[i].revents = POLLNVAL;
+            continue;
+        }
+        if (!(req = vfs_req_spare())) {
+            p->again = 1;   /* the next round asks */
+            continue;
+        }
+        req->msg.cmd = VFS_POLL;
+        req->msg.client = p->client;
+        req->msg.rw.ino = filp[fp].ino;
+        req->msg.rw.pos = i;
+        req->msg.rw.data = p->fds[i].events;
+        req->fp = -1;
+        p->devs |= (1 << filp[fp].dev);
+        p->pending++;
+        vfs_queue(filp[fp].dev, req);
+    }
+    if (p->pending) {
+        return;
+    }
+    if (p->again && !vfs_poll_ready(p)) {
+        vfs_poll_reply(p, EOF);     /* no requests for any of them */
+        return;
+    }
+    vfs_poll_end(p);
+}
+
+/*
+ * The answer of a driver in a round
+ */
+static void
+vfs_polled (vfs_req_t* req, vfsmsg_t *msg) {
+    vfs_poller_t* p;
+    int i;
+
+    for (i = 0; i != VFS_POLLERS; i++) {
+        p = &vfs_poller[i];
+        if (p->client && (p->client == req->msg.client) && p->pending) {
+            p->fds[req->msg.rw.pos].revents = msg->rw.data;
+            vfs_req_free(req);
+            if (!(--(p->pending))) {
+                vfs_poll_end(p);
+            }
+            return;
+        }
+    }
+    vfs_req_free(req);
+}
+
+/*
+ * Devices have notified the VFS, the rounds of their pollers start over
+ */
+static void
+vfs_poll_notify (unsigned char devs) {
+    vfs_poller_t* p;
+    int i;
+
+    for (i = 0; i != VFS_POLLERS; i++) {
+        p = &vfs_poller[i];
+        if (!p->client || !(p->devs & devs)) {
+            continue;
+        }
+        if (p->pending) {
+            p->again = 1;
+        } else {
+            vfs_poll_round(p);
+        }
+    }
+}
 
 
 /*
@@ -59,6 +394,21 @@ find_empty_devtab (void) {
     return (-1);
 }
 
+/*
+ *
+ */
+
+static int
+find_devtab (pid_t pid) {
+    int i;
+    for (i = 0; i < MAX_DEV; i++) {
+        if (devtab[i] == pid) {
+            return i;
+        }
+    }
+    return (-1);
+}
+
 /*
  *
  */
@@ -145,6 +495,53 @@ do_mkdev (vfsmsg_t *msg) {
     return;
 }
 
+/*
+ *  DCACHE - directory entries resolved lately, direct mapped by
+ *  (dev, dir ino, name hash). Longer names always go to the driver.
+ */
+
+#define DCACHE_SIZE     (8)     /* power of 2 */
+#define DCACHE_NAME     (6)
+
+typedef struct dcache_s {
+    int                 dev;    /* -1: empty */
+    int                 dir;
+    int                 ino;
+    unsigned char       hash;
+    unsigned char       len;
+    char                name[DCACHE_NAME];
+} dcache_t;
+
+static dcache_t         dcache[DCACHE_SIZE];
+
+static unsigned char
+dcache_hash (int dev, int dir, char* name, int nlen) {
+    unsigned char h = dev + dir * 7;
+    while (nlen--) {
+        h = h * 31 + *name++;
+    }
+    return (h);
+}
+
+static dcache_t*
+dcache_find (int dev, int dir, char* name, int nlen, unsigned char h) {
+    dcache_t* d = &dcache[h & (DCACHE_SIZE - 1)];
+    if ((d->dev == dev) && (d->dir == dir) && (d->hash == h) &&
+        (d->len == nlen) && !memcmp(d->name, name, nlen)) {
+        return (d);
+    }
+    return (NULL);
+}
+
+static void
+dcache_drop (int dev, int dir, char* name, int nlen) {
+    dcache_t* d = dcache_find(dev, dir, name, nlen,
+                              dcache_hash(dev, dir, name, nlen));
+    if (d) {
+        d->dev = -1;
+    }
+}
+
 /*
  *   name = "abcd"    nlen == 4
  */
@@ -153,7 +550,12 @@ vfs_get_direntry (int *dev, int ino, char* name, int nlen) {
     vfsmsg_t msg;
     int i;
     char* n;
+    unsigned char h = dcache_hash(*dev, ino, name, nlen);
+    dcache_t* d = dcache_find(*dev, ino, name, nlen, h);
 
+    if (d) {
+        return (d->ino);
+    }
     msg.cmd = VFS_GET_DIRENTRY;
     msg.link.ino = ino;
 
@@ -166,8 +568,18 @@ vfs_get_direntry (int *dev, int ino, char* name, int nlen) {
     }
     n[i] = '\0';
     msg.link.name = n;
-    sendrec(devtab[*dev], &msg, sizeof(msg));
+    vfs_call(*dev, &msg);
     kfree(n);
+    debugn++;   /* lookups that reached a driver */
+    if ((msg.link.ino >= 0) && (nlen <= DCACHE_NAME)) {
+        d = &dcache[h & (DCACHE_SIZE - 1)];
+        d->dev = *dev;
+        d->dir = ino;
+        d->ino = msg.link.ino;
+        d->hash = h;
+        d->len = nlen;
+        memcpy(d->name, name, nlen);
+    }
     return (msg.link.ino);
 }
 
@@ -227,6 +639,22 @@ vfs_get_node (vfs_task_t *client, int *dev, char* path) {
     return ino;
 }
 
+/*
+ * VFS_LINK, VFS_UNLINK of name in dir_ino: the cached entry goes first
+ */
+static int
+vfs_link (int dev, vfsmsg_t *msg, int cmd, int dir_ino, char* name, int ino) {
+    int len;
+    char* bn = basename(name, &len);
+    dcache_drop(dev, dir_ino, bn, len);
+    msg->cmd = cmd;
+    msg->link.name = name;
+    msg->link.ino = ino;
+    msg->link.dir_ino = dir_ino;
+    vfs_call(dev, msg);
+    return (msg->link.ino);
+}
+
 
 /*
  *
@@ -248,16 +676,11 @@ do_mknod (vfs_task_t *client, vfsmsg_t *msg) {
         return;
     }
     /* Create new node on device */
-    sendrec(devtab[dev], msg, sizeof(vfsmsg_t));
+    vfs_call(dev, msg);
     ino = msg->mknod.ino;
 
     /* Link the node */
-    msg->cmd = VFS_LINK;
-    msg->link.name = n;
-    msg->link.ino = ino;
-    msg->link.dir_ino = dir_ino;
-    sendrec(devtab[dev], msg, sizeof(vfsmsg_t));
-    if (msg->link.ino < 0) {
+    if (vfs_link(dev, msg, VFS_LINK, dir_ino, n, ino) < 0) {
         msg->mknod.ino = -1;
         return; /* Cannot get node */
     }
@@ -293,7 +716,7 @@ do_pipe (vfs_task_t *client, vfsmsg_t *msg) {
 
     /* Create inode on device */
     msg->cmd = VFS_MKNOD;
-    sendrec(devtab[pipedev_idx], msg, sizeof(vfsmsg_t));
+    vfs_call(pipedev_idx, msg);
     if (msg->mknod.ino < 0) {
         msg->pipe.result = -1;
         return; /* Cannot create node */
@@ -303,7 +726,7 @@ do_pipe (vfs_task_t *client, vfsmsg_t *msg) {
     /* Get this new node  2x */
     msg->cmd = VFS_INODE_GRAB;
     msg->iget.ino = ino;
-    sendrec(devtab[pipedev_idx], msg, sizeof(vfsmsg_t));
+    vfs_call(pipedev_idx, msg);
 
     if (msg->iget.ino < 0) {
         msg->pipe.result = -1;
@@ -312,7 +735,7 @@ do_pipe (vfs_task_t *client, vfsmsg_t *msg) {
 
     msg->cmd = VFS_INODE_GRAB;
     msg->iget.ino = ino;
-    sendrec(devtab[pipedev_idx], msg, sizeof(vfsmsg_t));
+    vfs_call(pipedev_idx, msg);
 
     if (msg->iget.ino < 0) {
         msg->pipe.result = -1;
@@ -384,7 +807,7 @@ do_open (vfs_task_t *client, vfsmsg_t *msg) {
     /* Get the node */
     msg->cmd = VFS_INODE_GRAB;
     msg->iget.ino = filp[fp].ino;
-    sendrec(devtab[filp[fp].dev], msg, sizeof(vfsmsg_t));
+    vfs_call(filp[fp].dev, msg);
 
     if (msg->iget.ino < 0) {
         /* Node not found on dev */
@@ -406,6 +829,7 @@ do_open (vfs_task_t *client, vfsmsg_t *msg) {
 static void
 do_close (vfs_task_t *client, vfsmsg_t *msg) {
     int fp;
+    vfs_req_t* req;
 
     if (msg->openclose.fd < 0) {
         return; /* Nothing to close */
@@ -422,21 +846,19 @@ do_close (vfs_task_t *client, vfsmsg_t *msg) {
         return; /* refcnt not zero yet */
     }
 
-    /* No more refs, close this node */
-    msg->cmd = VFS_INODE_RELEASE;
-    msg->iget.ino = filp[fp].ino;
-    sendrec(devtab[filp[fp].dev], msg, sizeof(vfsmsg_t));
-
-    while (msg->cmd == VFS_REPEAT) {
-        msg->cmd = VFS_FINAL;
-        /* Unblocking waiting tasks(s) */
-        send(msg->client, msg);
-        sendrec(devtab[filp[fp].dev], msg, sizeof(vfsmsg_t));
-    }
-    if (msg->iget.ino < 0) {
-        return; /* Node not found on dev */
+    /* No more refs, the device releases the node when it gets to it */
+    req = vfs_req_spare();
+    if (!req) {
+        msg->cmd = VFS_INODE_RELEASE;   /* table full, wait for it */
+        msg->iget.ino = filp[fp].ino;
+        vfs_call(filp[fp].dev, msg);
+        return;
     }
-
+    req->msg.cmd = VFS_INODE_RELEASE;
+    req->msg.client = NULL;
+    req->msg.iget.ino = filp[fp].ino;
+    req->fp = -1;
+    vfs_queue(filp[fp].dev, req);
     return;
 }
 
@@ -447,6 +869,7 @@ do_close (vfs_task_t *client, vfsmsg_t *msg) {
 static void
 do_rw (vfs_task_t *client, vfsmsg_t *msg) {
     int fp;
+    vfs_req_t* req;
 
     if (msg->rw.fd < 0) {
         msg->rw.data = EOF; /* wrong fd */
@@ -459,53 +882,159 @@ do_rw (vfs_task_t *client, vfsmsg_t *msg) {
         return;
     }
 
+    req = POOL_ALLOC(vfs_req, vfs_req_t);
+    if (!req) {
+        msg->rw.data = EOF; /* can't be, see VFS_REQ_MAX */
+        return;
+    }
     msg->rw.ino = filp[fp].ino;
-    msg->rw.pos = filp[fp].pos;
+    msg->rw.bnum = 0;
+    memcpy(&(req->msg), msg, sizeof(vfsmsg_t));
+    req->fp = fp;
+    vfs_queue(filp[fp].dev, req);
+    msg->cmd = VFS_HOLD;    /* answered by vfs_complete() */
+    return;
+}
+
+/*
+ * The channel of an fd, if its driver grants one
+ */
 
-    sendrec(devtab[filp[fp].dev], msg, sizeof(vfsmsg_t));
+static void
+do_chan (vfs_task_t *client, vfsmsg_t *msg) {
+    int fp;
 
-    while (msg->cmd == VFS_REPEAT) {
-        msg->cmd = VFS_FINAL;
-        if (msg->client) {
-            /* Unblocking waiting tasks(s) */
-            send(msg->client, msg);
-        }
-        sendrec(devtab[filp[fp].dev], msg, sizeof(vfsmsg_t));
+    msg->chan.ch.driver = NULL;
+    if ((msg->chan.fd < 0) || (msg->chan.fd >= MAX_FD)) {
+        return; /* wrong fd */
     }
-    filp[fp].pos += msg->rw.bnum;
+    fp = client->fd[msg->chan.fd];
+    if (fp < 0) {
+        return; /* wrong fd */
+    }
+    msg->chan.fd = filp[fp].ino;
+    msg->chan.ch.ino = -1;
+    vfs_call(filp[fp].dev, msg);
+    if (msg->chan.ch.ino >= 0) {
+        msg->chan.ch.driver = devtab[filp[fp].dev];
+    }
+    return;
+}
 
+/*
+ * Interrupt notifications, drivers never block on the VFS
+ */
+
+static void
+do_notify (unsigned int bits) {
+    unsigned char devs = 0;
+    int i;
+    for (i = 0; i < MAX_DEV; i++) {
+        if (bits & VFS_NOTIFY_RD(i)) {
+            vfs_dev[i].irq |= VFS_IRQ_RD;
+        }
+        if (bits & VFS_NOTIFY_WR(i)) {
+            vfs_dev[i].irq |= VFS_IRQ_WR;
+        }
+        if (bits & (VFS_NOTIFY_RD(i) | VFS_NOTIFY_WR(i))) {
+            devs |= (1 << i);
+        }
+        vfs_kick(i);
+    }
+    vfs_poll_notify(devs);  /* asked after the interrupts */
     return;
 }
 
+/*
+ * Waits until an fd is ready, see POLL
+ */
 
 static void
-do_int (vfsmsg_t *msg) {
-    pid_t client = msg->client;
-    sendrec(client, msg, sizeof(vfsmsg_t));
-    while (msg->cmd == VFS_REPEAT) {
-        msg->cmd = VFS_FINAL;
-        if (msg->client) {
-            /* Unblocking waiting tasks(s) */
-            send(msg->client, msg);
+do_poll (vfs_task_t *client, vfsmsg_t *msg) {
+    vfs_poller_t* p = NULL;
+    int i;
+
+    for (i = 0; i != VFS_POLLERS; i++) {
+        if (!vfs_poller[i].client) {
+            p = &vfs_poller[i];
+            break;
         }
-        sendrec(client, msg, sizeof(vfsmsg_t));
     }
+    if (!p) {
+        msg->poll.n = EOF;  /* too many pollers */
+        return;
+    }
+    p->client = client->pid;
+    p->task = client;
+    p->fds = msg->poll.fds;
+    p->n = msg->poll.n;
+    p->wait = (msg->poll.wait != 0);
+    p->pending = 0;
+    vfs_poll_round(p);      /* may answer already */
+    msg->cmd = VFS_HOLD;
     return;
 }
+
 /*
  * =============
  */
 
 static vfs_task_t*
 vfs_findbypid (pid_t pid) {
-    vfs_task_t *it = (vfs_task_t*)Q_FIRST(vfs_task_q);
-    while (it) {
-        if (it->pid == pid) {
+    unsigned char h = VFS_HASHOF(pid);
+    while (vfs_hash[h]) {
+        if (vfs_slot[vfs_hash[h] - 1]->pid == pid) {
+            return (vfs_slot[vfs_hash[h] - 1]);
+        }
+        h = (h + 1) & (VFS_HASH - 1);
+    }
+    return (NULL);
+}
+
+/*
+ * Takes a free slot and hashes the pid to it, -1 if all are taken
+ */
+static int
+vfs_slot_take (vfs_task_t* pt) {
+    unsigned char s;
+    unsigned char h;
+    for (s = 0; s != VFS_SLOTS; s++) {
+        if (!vfs_slot[s]) {
             break;
         }
-        it = (vfs_task_t*)Q_NEXT(it);
     }
-    return (it);
+    if (s == VFS_SLOTS) {
+        return (-1);
+    }
+    vfs_slot[s] = pt;
+    pt->slot = s;
+    for (h = VFS_HASHOF(pt->pid); vfs_hash[h]; h = (h + 1) & (VFS_HASH - 1));
+    vfs_hash[h] = s + 1;
+    return (s);
+}
+
+/*
+ * Frees the slot. The entries after the hole move back if their home
+ * is not between the hole and them, no probe chain is cut.
+ */
+static void
+vfs_slot_drop (vfs_task_t* pt) {
+    unsigned char h;
+    unsigned char j;
+    unsigned char k;
+    for (h = VFS_HASHOF(pt->pid); vfs_hash[h] != pt->slot + 1;
+         h = (h + 1) & (VFS_HASH - 1));
+    vfs_hash[h] = 0;
+    for (j = (h + 1) & (VFS_HASH - 1); vfs_hash[j];
+         j = (j + 1) & (VFS_HASH - 1)) {
+        k = VFS_HASHOF(vfs_slot[vfs_hash[j] - 1]->pid);
+        if (((j - k) & (VFS_HASH - 1)) >= ((j - h) & (VFS_HASH - 1))) {
+            vfs_hash[h] = vfs_hash[j];
+            vfs_hash[j] = 0;
+            h = j;
+        }
+    }
+    vfs_slot[pt->slot] = NULL;
 }
 
 /*
@@ -523,7 +1052,8 @@ vfs_removetask (vfsmsg_t *msg) {
         msg->openclose.fd = i;
         do_close(pt, msg);
     }
-    kfree(Q_REMV(&vfs_task_q, pt));
+    vfs_slot_drop(pt);
+    kfree(pt);
     return (pt);
 }
 
@@ -543,8 +1073,12 @@ vfs_addnewtask (vfsmsg_t *msg) {
         return;
     }
     memset(pt, 0x00, sizeof(vfs_task_t));
-    Q_END(&vfs_task_q, pt);
     pt->pid = msg->adddel.pid;
+    if (vfs_slot_take(pt) < 0) {
+        kfree(pt);
+        msg->adddel.pid = NULL;
+        return;
+    }
     for (i = 0; i != MAX_FD; i++) {
         pt->fd[i] = (-1);
     }
@@ -581,9 +1115,19 @@ vfs_addnewtask (vfsmsg_t *msg) {
 
 static void
 vfs_init (vfsmsg_t *msg) {
+    int i;
+
     memset(filp, 0, (sizeof(filp)));
     memset(devtab, 0, (sizeof(devtab)));
-    q_init(&vfs_task_q);
+    memset(dcache, 0xFF, (sizeof(dcache)));    /* dev -1 */
+    memset(vfs_dev, 0, (sizeof(vfs_dev)));
+    for (i = 0; i != MAX_DEV; i++) {
+        q_init(&(vfs_dev[i].req_q));
+    }
+    POOL_INIT(vfs_req, vfs_req_t);
+    memset(vfs_slot, 0, (sizeof(vfs_slot)));
+    memset(vfs_hash, 0, (sizeof(vfs_hash)));
+    memset(vfs_poller, 0, (sizeof(vfs_poller)));
 
     /* set up pipe device */
     msg->cmd = VFS_MKDEV;
@@ -602,16 +1146,31 @@ vfs_init (vfsmsg_t *msg) {
 void
 vfs (void* args UNUSED) {
     pid_t client;
+    pid_t replyto = NULL;
     vfs_task_t *vfs_client;
     vfsmsg_t msg;
+    int i;
 
     kirqdis();
+    setvfspid(getpid());    /* drivers started here ask for their dev */
     vfs_init(&msg);
 
     debugn = 0;
     while (1) {
-        client = receive(TASK_ANY, &msg, sizeof(msg));
+        client = replyrecv(replyto, &msg, sizeof(msg));
+        replyto = NULL;
+        if (client == TASK_NOTIFY) {
+            do_notify(getnotify());
+            continue;
+        }
         vfs_client = vfs_findbypid(client);
+        if (!vfs_client && ((i = find_devtab(client)) >= 0) &&
+            vfs_dev[i].busy) {
+            /* a driver answers */
+            replyto = vfs_driver(i, &msg);
+            vfs_kick(i);
+            continue;
+        }
         switch (msg.cmd) {
 
           case VFS_ADDTASK:
@@ -650,18 +1209,26 @@ vfs (void* args UNUSED) {
             do_close(vfs_client, &msg);
             break;
 
-          case VFS_RD_INTERRUPT:
-          case VFS_WR_INTERRUPT:
-            do_int(&msg);
-            client = msg.client;
+          case VFS_GETDEV:
+            msg.interrupt.data = find_devtab(client);
             break;
 
           case VFS_READC:
           case VFS_WRITEC:
+          case VFS_READ:
+          case VFS_WRITE:
             msg.client = client;    /* May be delayed, save client */
             do_rw(vfs_client, &msg);
             break;
 
+          case VFS_CHANNEL:
+            do_chan(vfs_client, &msg);
+            break;
+
+          case VFS_POLL:
+            do_poll(vfs_client, &msg);
+            break;
+
           case VFS_DEBUG:
             if (msg.interrupt.data) {
                 debugn = 0;
@@ -672,7 +1239,7 @@ vfs (void* args UNUSED) {
 
         if ((msg.cmd != VFS_HOLD) && client) {
             msg.cmd = VFS_FINAL;
-            send(client, &msg);
+            replyto = client;
         }
     }
 }
@@ -694,19 +1261,67 @@ setvfspid (pid_t pid) {
 }
 
 void
-vfs_rd_interrupt (pid_t driver) {
-    vfsmsg_t msg;
-    msg.client = driver;
-    msg.cmd = VFS_RD_INTERRUPT;
-    send(vfstask, &msg);
+vfs_rd_interrupt (int dev) {
+    notify(vfstask, VFS_NOTIFY_RD(dev));
 }
 
 void
-vfs_wr_interrupt (pid_t driver) {
+vfs_wr_interrupt (int dev) {
+    notify(vfstask, VFS_NOTIFY_WR(dev));
+}
+
+/*
+ * devtab index of the calling driver
+ */
+
+int
+vfs_getdev (void) {
     vfsmsg_t msg;
-    msg.client = driver;
-    msg.cmd = VFS_WR_INTERRUPT;
-    send(vfstask, &msg);
+    msg.cmd = VFS_GETDEV;
+    sendrec(vfstask, &msg, sizeof(msg));
+    return (msg.interrupt.data);
+}
+
+/*
+ * Driver side: the answer to a request the driver held. A direct one
+ * goes to its client, one of the VFS back to the VFS, which only
+ * listens while it waits for the driver: cur, the message served now,
+ * must have come from it. Returns 0 if the answer has to wait for that.
+ */
+
+int
+vfs_answer (vfsmsg_t* cur, vfsmsg_t* held) {
+    if (!held->client) {
+        return (1);     /* nobody waits */
+    }
+    if (held->tag == VFS_DIRECT) {
+        held->cmd = VFS_FINAL;
+        send(held->client, held);
+        return (1);
+    }
+    if (cur->tag == VFS_DIRECT) {
+        return (0);
+    }
+    held->cmd = VFS_REPEAT;
+    sendrec(vfstask, held, sizeof(vfsmsg_t));
+    return (1);
+}
+
+/*
+ * Driver side replyrecv(): a direct request on hold gets no reply,
+ * vfs_answer() sends it later. A new direct request has its client set.
+ */
+
+pid_t
+vfs_replyrecv (pid_t client, vfsmsg_t* msg) {
+    if ((msg->tag == VFS_DIRECT) && (msg->cmd == VFS_HOLD)) {
+        client = NULL;
+    }
+    client = replyrecv(client, msg, sizeof(vfsmsg_t));
+    if (msg->tag == VFS_DIRECT) {
+        msg->client = client;
+    }
+    return (client);
 }
 
 /*
@@ -736,6 +1351,101 @@ readc (int fd) {
     return (msg.rw.data);
 }
 
+/*
+ * Reads what the file has, up to n bytes (up to a line on a terminal).
+ * Returns the bytes read, 0 at the end of the file, EOF on error.
+ */
+
+int
+read (int fd, void* buf, int n) {
+    vfsmsg_t msg;
+    msg.rw.fd = fd;
+    msg.rw.data = n;
+    msg.rw.buf = buf;
+    msg.cmd = VFS_READ;
+    sendrec(vfstask, &msg, sizeof(msg));
+    return (msg.rw.data);
+}
+
+/*
+ * A driver may take less than asked (a pipe hands over as much as the
+ * reader wants), the rest goes in the next round. Returns the bytes
+ * written, EOF if nothing could be.
+ */
+
+int
+write (int fd, const void* buf, int n) {
+    vfsmsg_t msg;
+    int done = 0;
+    while (done < n) {
+        msg.rw.fd = fd;
+        msg.rw.data = n - done;
+        msg.rw.buf = (char*)buf + done;
+        msg.cmd = VFS_WRITE;
+        sendrec(vfstask, &msg, sizeof(msg));
+        if (msg.rw.data <= 0) {
+            return (done ? done : EOF);
+        }
+        done += msg.rw.data;
+    }
+    return (done);
+}
+
+/*
+ * The channel of an open fd. Returns 0, EOF if the fd isn't open or
+ * its driver grants none.
+ */
+
+int
+fdchan (int fd, vfschan_t* ch) {
+    vfsmsg_t msg;
+    msg.cmd = VFS_CHANNEL;
+    msg.chan.fd = fd;
+    sendrec(vfstask, &msg, sizeof(msg));
+    memcpy(ch, &msg.chan.ch, sizeof(vfschan_t));
+    return (ch->driver ? 0 : EOF);
+}
+
+/*
+ * read() and write() through a channel, one message to the driver and
+ * its answer instead of two of each through the VFS
+ */
+
+int
+chread (vfschan_t* ch, void* buf, int n) {
+    vfsmsg_t msg;
+    msg.cmd = VFS_READ;
+    msg.tag = VFS_DIRECT;
+    msg.rw.ino = ch->ino;
+    msg.rw.gen = ch->gen;
+    msg.rw.pos = 0;
+    msg.rw.data = n;
+    msg.rw.buf = buf;
+    sendrec(ch->driver, &msg, sizeof(msg));
+    return (msg.rw.data);
+}
+
+int
+chwrite (vfschan_t* ch, const void* buf, int n) {
+    vfsmsg_t msg;
+    int done = 0;
+    while (done < n) {
+        msg.cmd = VFS_WRITE;
+        msg.tag = VFS_DIRECT;
+        msg.rw.ino = ch->ino;
+        msg.rw.gen = ch->gen;
+        msg.rw.pos = 0;
+        msg.rw.data = n - done;
+        msg.rw.buf = (char*)buf + done;
+        sendrec(ch->driver, &msg, sizeof(msg));
+        if (msg.rw.data <= 0) {
+            return (done ? done : EOF);
+        }
+        done += msg.rw.data;
+    }
+    return (done);
+}
+
 /*
  *
  */
@@ -838,6 +1548,32 @@ open (char *name) {
     return (msg.openclose.fd);
 }
 
+/*
+ * Waits until one of the n fds is ready for its events, or only checks
+ * them if wait is 0. Returns the fds ready, EOF on error.
+ */
+
+int
+poll (struct pollfd* fds, int n, int wait) {
+    vfsmsg_t msg;
+    msg.cmd = VFS_POLL;
+    msg.poll.fds = fds;
+    msg.poll.n = n;
+    msg.poll.wait = wait;
+    sendrec(vfstask, &msg, sizeof(msg));
+    return (msg.poll.n);
+}
+
+/*
+ * One hook for all processes, it finds the process's own channels itself
+ */
+static void (*vfs_closehook)(int fd);
+
+void
+vfs_onclose (void (*fn)(int fd)) {
+    vfs_closehook = fn;
+}
+
 /*
  *
  */
@@ -845,6 +1581,9 @@ open (char *name) {
 void
 close (int fd) {
     vfsmsg_t msg;
+    if (vfs_closehook) {
+        vfs_closehook(fd);
+    }
     msg.cmd = VFS_CLOSE;
     msg.openclose.fd = fd;
     sendrec(vfstask, &msg, sizeof(msg));
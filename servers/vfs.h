@@ -24,6 +24,7 @@ enum {
 
 
     VFS_GET_DIRENTRY,
+    VFS_GETDEV,
     VFS_DEBUG,
 
 
@@ -35,10 +36,27 @@ enum {
     VFS_CREAT,
     VFS_READC,
     VFS_WRITEC,
+    VFS_READ,
+    VFS_WRITE,
+    VFS_CHANNEL,
+    VFS_POLL,
     VFS_ADDTASK,
     VFS_DELTASK
 };
 
+/*
+ * Interrupt notification bits, two per devtab slot
+ */
+
+#define VFS_NOTIFY_RD(dev)      (0x0001 << ((dev) << 1))
+#define VFS_NOTIFY_WR(dev)      (0x0002 << ((dev) << 1))
+
+/*
+ * Tag of a request a client sent to the driver itself, through a channel
+ */
+
+#define VFS_DIRECT              (0xFF)
+
 /*
  *
  */
@@ -60,7 +78,9 @@ typedef struct adddel_s {
 
 
 /*
- * CHAR READ/WRITE
+ * CHAR AND BLOCK READ/WRITE
+ * A block call carries the byte count in data, the driver copies
+ * straight from/to buf and answers with the bytes moved.
  */
 
 typedef struct rwc_s {
@@ -72,9 +92,55 @@ typedef struct rwc_s {
         int             pos;
         int             bnum;
     };
-    int             data;       /* data */
+    int             data;       /* data, byte count of a block */
+    char*           buf;        /* block */
+    unsigned int    gen;        /* node generation, direct requests */
 } rwc_t;
 
+/*
+ * CHANNEL
+ * The driver and node of an open fd, for reads and writes straight to
+ * the driver. The VFS asks the driver with the ino in fd and ch.ino -1,
+ * a driver grants the channel by setting ch.ino and the generation of
+ * the node: a direct request of a node freed and made again since is
+ * refused. Only drivers without a position grant them, the position of
+ * a file stays with its filp in the VFS. Valid until the fd is closed.
+ */
+
+typedef struct vfschan_s {
+    pid_t           driver;     /* NULL: no channel */
+    int             ino;
+    unsigned int    gen;
+} vfschan_t;
+
+typedef struct chan_s {
+    int             fd;         /* ino to the driver */
+    vfschan_t       ch;
+} chan_t;
+
+/*
+ * POLL
+ * A client asks for the events of its fds, a driver for one node: the
+ * VFS sends each driver a read/write message, ino and index of the fd,
+ * the events in data. The driver answers with the ones that are ready.
+ */
+
+#define POLLIN      (0x01)      /* a read doesn't block */
+#define POLLOUT     (0x02)      /* a write doesn't block */
+#define POLLNVAL    (0x04)      /* not an open fd */
+
+struct pollfd {
+    int     fd;
+    int     events;
+    int     revents;
+};
+
+typedef struct poll_s {
+    struct pollfd*  fds;
+    int             n;          /* fds ready in the answer, EOF */
+    int             wait;       /* 0: don't wait for one */
+} poll_t;
+
 /*
  * OPEN CLOSE
  */
@@ -182,11 +248,14 @@ typedef struct link_s {
 typedef struct vfsmsg_s {
     int             cmd;        /* command */
     pid_t           client;     /* client (client who requests IO) */
+    unsigned char   tag;        /* VFS request, drivers keep it */
     union {
         interrupt_t     interrupt;
         stat_t          stat;       /* stat */
         openclose_t     openclose;  /* open close*/
         rwc_t           rw;         /* character read/write */
+        chan_t          chan;
+        poll_t          poll;
         mkdev_t         mkdev;
         mknod_t         mknod;
         dup_t           dup;
@@ -209,8 +278,11 @@ typedef struct vfsmsg_container_s {
 
 void vfs (void* args);
 
-void vfs_rd_interrupt (pid_t driver);
-void vfs_wr_interrupt (pid_t driver);
+void vfs_rd_interrupt (int dev);
+void vfs_wr_interrupt (int dev);
+int vfs_getdev (void);
+int vfs_answer (vfsmsg_t* cur, vfsmsg_t* held);
+pid_t vfs_replyrecv (pid_t client, vfsmsg_t* msg);
 
 pid_t setvfspid (pid_t pid);
 
@@ -226,6 +298,13 @@ int fstat (char *name, struct stat *st_stat);
 void close (int fd);
 int readc (int fd);
 int writec (int fd, int c);
+int read (int fd, void* buf, int n);
+int write (int fd, const void* buf, int n);
+int fdchan (int fd, vfschan_t* ch);
+int chread (vfschan_t* ch, void* buf, int n);
+int chwrite (vfschan_t* ch, const void* buf, int n);
+void vfs_onclose (void (*fn)(int fd));
+int poll (struct pollfd* fds, int n, int wait);
 
 int vfs_debugn (int reset);
 
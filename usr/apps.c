@@ -2,13 +2,18 @@
 #include "../servers/ts.h"
 #include "../servers/pm.h"
 #include "../servers/vfs.h"
+#include "../servers/ex.h"
 #include "../lib/mstddef.h"  /* EOF */
+#include "../lib/pool.h"
 
 #include "lib/mstdlib.h"
+#include "lib/umalloc.h"
 #include <string.h>
 
 #include "apps.h"
 
+#define APPS_BLOCK      (16)    /* cat, cap: bytes per read() */
+
 
 /*
  * getty [filename]
@@ -109,8 +114,9 @@ echo (char** argv) {
 
 void
 docat (void) {
-    int c;
-    while((c = mgetc()) != EOF) {mfputc(1, c);}
+    char buf[APPS_BLOCK];
+    int n;
+    while((n = read(0, buf, sizeof(buf))) > 0) {write(1, buf, n);}
 }
 
 int
@@ -140,12 +146,15 @@ cat (char** argv) {
 
 void
 docap (void) {
-    int c;
-    while((c = mgetc()) != EOF) {
-        if (c >= 'a' && c <= 'z') {
-            c = c - ('a' - 'A');
+    char buf[APPS_BLOCK];
+    int n, i;
+    while((n = read(0, buf, sizeof(buf))) > 0) {
+        for (i = 0; i != n; i++) {
+            if (buf[i] >= 'a' && buf[i] <= 'z') {
+                buf[i] = buf[i] - ('a' - 'A');
+            }
         }
-        mfputc(1, c);
+        write(1, buf, n);
     }
 }
 
@@ -355,7 +364,7 @@ dogrep (char* regexp, int opt) {
             pos++;
         }
         if (pos) { /* otherwise it's just an eof */
-            pos = (int)strstr(line, regexp);
+            pos = (strstr(line, regexp) != NULL);
             rc = pos ? 0 : rc;
             if (opt & GREP_INV ? !pos : pos) {
                 mfprintf(1, "%s\n", line);
@@ -456,3 +465,167 @@ int fs_debug (char** argv) {
     return (0);
 }
 
+
+/*
+ * top
+ *
+ * display task statistics, CPU usage is measured over one second
+ */
+
+static int
+top_find (pid_t* pids, int n, pid_t pid) {
+    int i;
+    for (i = 0; i != n; i++) {
+        if (pids[i] == pid) {
+            return (i);
+        }
+    }
+    return (-1);
+}
+
+int
+top (char** argv UNUSED) {
+    taskstat_t      st;
+    pid_t*          pids;
+    unsigned long*  ticks;
+    unsigned long   total;
+    unsigned long   t0;
+    pid_t           pid;
+    int             n;
+    int             m;
+    int             i;
+
+    pids = pmmalloc(sizeof(pid_t) * TASK_MAX);
+    ticks = pmmalloc(sizeof(unsigned long) * TASK_MAX);
+    ASSERT(pids && ticks);
+
+    /* first sample */
+    for (n = 0, pid = taskstat(NULL, &st); pid && (n != TASK_MAX);
+         n++, pid = taskstat(pid, &st)) {
+        pids[n] = pid;
+        ticks[n] = st.ticks;
+    }
+    delay(30);
+
+    /* second sample, the tasks seen in both move to the front with their
+     * ticks over the second, they make the total. The ticks of a reused
+     * pid went back, that's a new task. */
+    total = 0;
+    for (m = 0, pid = taskstat(NULL, &st); pid; pid = taskstat(pid, &st)) {
+        if (((i = top_find(pids + m, n - m, pid)) < 0) ||
+            (st.ticks < ticks[m + i])) {
+            continue;
+        }
+        i += m;
+        pids[i] = pids[m];
+        pids[m] = pid;
+        t0 = ticks[i];
+        ticks[i] = ticks[m];
+        ticks[m] = st.ticks - t0;
+        total += ticks[m++];
+    }
+    n = m;
+    if (!total) {
+        total = 1;
+    }
+    mfprintf(1, "PID PRI CPU KCALLS SENT RCVD PREEMPT STACK\n");
+    for (pid = taskstat(NULL, &st); pid; pid = taskstat(pid, &st)) {
+        i = top_find(pids, n, pid);
+        mfprintf(1, "%x %d %d %d %d %d %d %d/%d\n",
+                 pid,
+                 st.prio,
+                 (i >= 0) ? (int)((ticks[i] * 100) / total) : 0,
+                 st.kcalls,
+                 st.sent,
+                 st.received,
+                 st.preempted,
+                 st.stackpeak,
+                 st.stacksize);
+    }
+    pmfree(pids);
+    pmfree(ticks);
+    return (0);
+}
+
+/*
+ * stacks
+ *
+ * stack usage of the registered programs, measured over the runs since
+ * boot, and the recommended size for ex_regprg()
+ */
+
+#define STACKS_MARGIN   16
+
+int
+stacks (char** argv UNUSED) {
+    char*   name;
+    size_t  stack;
+    size_t  peak;
+    int     i;
+
+    mfprintf(1, "PRG SIZE PEAK REC\n");
+    for (i = 0; (name = ex_prginfo(i, &stack, &peak)); i++) {
+        mfprintf(1, "%s %d %d ", name, stack, peak);
+        if (peak) {
+            /* peak plus margin, rounded up to 8 bytes */
+            mfprintf(1, "%d\n", (peak + STACKS_MARGIN + 7) & ~7);
+        } else {
+            mfprintf(1, "-\n");    /* hasn't run yet */
+        }
+    }
+    return (0);
+}
+
+/*
+ * ktrace
+ *
+ * drains the kernel trace ring to the standard output, one record per
+ * line: time type code task peer (decode with misc/ktrace.c)
+ * Needs a kernel built with -DKTRACE
+ */
+
+#define KTRACE_CHUNK    8
+
+int
+ktrace_dump (char** argv UNUSED) {
+    ktrace_t*   buf;
+    int         n;
+    int         i;
+
+    buf = pmmalloc(sizeof(ktrace_t) * KTRACE_CHUNK);
+    ASSERT(buf);
+    while ((n = ktrace(buf, KTRACE_CHUNK))) {
+        for (i = 0; i != n; i++) {
+            mfprintf(1, "%x %c %x %x %x\n",
+                     buf[i].time,
+                     buf[i].type,
+                     buf[i].code,
+                     buf[i].task,
+                     buf[i].peer);
+        }
+    }
+    pmfree(buf);
+    return (0);
+}
+
+/*
+ * pools
+ *
+ * statistics of the fixed-size object pools
+ */
+
+int
+pools (char** argv UNUSED) {
+    pool_t* p;
+    mfprintf(1, "POOL SIZE USED/TOTAL PEAK FAILS\n");
+    for (p = pool_next(NULL); p; p = pool_next(p)) {
+        mfprintf(1, "%s %d %d/%d %d %d\n",
+                 p->name,
+                 p->size,
+                 p->used,
+                 p->total,
+                 p->peak,
+                 p->fails);
+    }
+    return (0);
+}
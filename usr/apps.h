@@ -25,4 +25,12 @@ int repeat (char** argv);
 
 int fs_debug (char** argv);
 
+int top (char** argv);
+
+int stacks (char** argv);
+
+int ktrace_dump (char** argv);
+
+int pools (char** argv);
+
 #endif
@@ -0,0 +1,295 @@
+#include <avr/io.h>
+#include <util/atomic.h>
+
+#include "../kernel/kernel.h"
+#include "../servers/ts.h"
+#include "../servers/pm.h"
+#include "../servers/vfs.h"
+
+#include "lib/mstdlib.h"
+
+#include "bench.h"
+
+/*
+ * bench [device]
+ *
+ * Runs the IPC and system call primitives n times each and prints the
+ * cost as CSV: primitive,n,counts,cycles
+ *
+ *   counts: Timer1 counts for the n runs, clk/1024 as set up by ts
+ *   cycles: CPU cycles of one run, loop overhead included (see 'null')
+ *
+ * The peer of a message or pipe primitive is a child task, doing the
+ * other half of the exchange. A run must stay below one Timer1 period
+ * (4.19 s at 16 MHz), n is chosen for that. The '+8' runs have eight
+ * more processes sitting idle, as many concurrent sessions would.
+ * 'chread' is 'readc' through the channel of the pipe, without the VFS,
+ * 'poll' waits for the pipe with poll() before each 'readc'.
+ *
+ * With [device] the standard fds are opened on it first and the task
+ * parks after the report, for the headless image ('make bench').
+ */
+
+#define BENCH_CYCLES_PER_COUNT  (1024UL)
+
+enum {
+    BENCH_NULL,
+    BENCH_KCALL,
+    BENCH_SEND,
+    BENCH_RECEIVE,
+    BENCH_SENDREC,
+    BENCH_SENDRECS,
+    BENCH_WRITEC,
+    BENCH_READC,
+    BENCH_CHREAD,
+    BENCH_POLL,
+    BENCH_SPAWN,
+    BENCH_DELAY,
+};
+
+typedef struct bench_s {
+    const char*     name;
+    int             cmd;
+    int             n;
+    int             idle;       /* idle processes during the run */
+} bench_t;
+
+static const bench_t benches[] = {
+    {"null",        BENCH_NULL,     256,    0},
+    {"getpid",      BENCH_KCALL,    256,    0},
+    {"send",        BENCH_SEND,     256,    0},
+    {"receive",     BENCH_RECEIVE,  256,    0},
+    {"sendrec",     BENCH_SENDREC,  256,    0},
+    {"sendrecs",    BENCH_SENDRECS, 256,    0},
+    {"writec",      BENCH_WRITEC,   64,     0},
+    {"readc",       BENCH_READC,    64,     0},
+    {"readc+8",     BENCH_READC,    64,     8},
+    {"chread",      BENCH_CHREAD,   64,     0},
+    {"poll",        BENCH_POLL,     64,     0},
+    {"spawntask",   BENCH_SPAWN,    16,     0},
+    {"delay1",      BENCH_DELAY,    16,     0},
+};
+
+#define BENCH_IDLE_MAX  (8)
+
+/* Control message of the peer, then the payload of the long messages */
+typedef struct benchmsg_s {
+    int             cmd;
+    int             n;
+    int             fd[2];
+    char            payload[8];
+} benchmsg_t;
+
+/*
+ *
+ */
+
+static unsigned int
+bench_clock (void) {
+    unsigned int t;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        t = TCNT1;
+    }
+    return (t);
+}
+
+static void
+bench_putul (int fd, unsigned long num) {
+    char buf[11];
+    int i = sizeof(buf);
+    buf[--i] = '\0';
+    do {
+        buf[--i] = '0' + (num % 10);
+        num /= 10;
+    } while (num);
+    mfprintf(fd, "%s", &buf[i]);
+}
+
+/*
+ * The other half of the exchange, started for each measurement
+ */
+
+static int
+bench_peer (char** argv UNUSED) {
+    benchmsg_t  msg;
+    smsg_t      smsg;
+    pid_t       parent;
+    pid_t       peer;
+    int         cmd;
+    int         n;
+    int         i;
+
+    parent = receive(TASK_ANY, &msg, sizeof(msg));
+    cmd = msg.cmd;
+    n = msg.n;
+    peer = NULL;
+    for (i = 0; i != n; i++) {
+        switch (cmd) {
+          case BENCH_SEND:
+            receive(parent, &msg, sizeof(msg));
+            break;
+          case BENCH_RECEIVE:
+            send(parent, &msg);
+            break;
+          case BENCH_SENDREC:   /* a server loop */
+            peer = replyrecv(peer, &msg, sizeof(msg));
+            break;
+          case BENCH_SENDRECS:
+            peer = replyrecvs(peer, &smsg);
+            break;
+          case BENCH_WRITEC:
+            readc(msg.fd[0]);
+            break;
+          case BENCH_READC:
+          case BENCH_CHREAD:
+          case BENCH_POLL:
+            writec(msg.fd[1], 'x');
+            break;
+        }
+    }
+    /* the last reply */
+    if (cmd == BENCH_SENDREC) {
+        send(peer, &msg);
+    } else if (cmd == BENCH_SENDRECS) {
+        sends(peer, &smsg);
+    }
+    return (0);
+}
+
+static int
+bench_nop (char** argv UNUSED) {
+    return (0);
+}
+
+/* Waits for the end of the run */
+static int
+bench_idle (char** argv UNUSED) {
+    receive(TASK_ANY, NULL, 0);
+    return (0);
+}
+
+/*
+ * Timer1 counts of n runs
+ */
+
+static unsigned int
+bench_run (int cmd, int n, int idle) {
+    benchmsg_t      msg;
+    smsg_t          smsg;
+    pid_t           peer = NULL;
+    pid_t           idlers[BENCH_IDLE_MAX];
+    vfschan_t       ch;
+    struct pollfd   pfd;
+    char            c;
+    unsigned int    t;
+    int             i;
+
+    for (i = 0; i != idle; i++) {
+        idlers[i] = spawntask(bench_idle, DEFAULT_STACK_SIZE, NULL);
+    }
+    msg.cmd = cmd;
+    msg.n = n;
+    if ((cmd == BENCH_WRITEC) || (cmd == BENCH_READC) ||
+        (cmd == BENCH_CHREAD) || (cmd == BENCH_POLL)) {
+        pipe(msg.fd);
+        fdchan(msg.fd[0], &ch);
+        pfd.fd = msg.fd[0];
+        pfd.events = POLLIN;
+    }
+    if ((cmd != BENCH_NULL) && (cmd != BENCH_KCALL) &&
+        (cmd != BENCH_SPAWN) && (cmd != BENCH_DELAY)) {
+        peer = spawntask(bench_peer, DEFAULT_STACK_SIZE, NULL);
+        send(peer, &msg);
+    }
+
+    t = bench_clock();
+    for (i = 0; i != n; i++) {
+        switch (cmd) {
+          case BENCH_KCALL:
+            getpid();
+            break;
+          case BENCH_SEND:
+            send(peer, &msg);
+            break;
+          case BENCH_RECEIVE:
+            receive(peer, &msg, sizeof(msg));
+            break;
+          case BENCH_SENDREC:
+            sendrec(peer, &msg, sizeof(msg));
+            break;
+          case BENCH_SENDRECS:
+            sendrecs(peer, &smsg);
+            break;
+          case BENCH_WRITEC:
+            writec(msg.fd[1], 'x');
+            break;
+          case BENCH_READC:
+            readc(msg.fd[0]);
+            break;
+          case BENCH_CHREAD:
+            chread(&ch, &c, 1);
+            break;
+          case BENCH_POLL:
+            poll(&pfd, 1, 1);
+            readc(msg.fd[0]);
+            break;
+          case BENCH_SPAWN:
+            spawntask(bench_nop, DEFAULT_STACK_SIZE, NULL);
+            wait(NULL);
+            break;
+          case BENCH_DELAY:
+            delay(1);
+            break;
+        }
+    }
+    t = (bench_clock() - t) & 0xFFFF;
+
+    if (peer) {
+        waitpid(peer, NULL);
+    }
+    if ((cmd == BENCH_WRITEC) || (cmd == BENCH_READC) ||
+        (cmd == BENCH_CHREAD) || (cmd == BENCH_POLL)) {
+        close(msg.fd[0]);
+        close(msg.fd[1]);
+    }
+    for (i = 0; i != idle; i++) {
+        send(idlers[i], &msg);
+        waitpid(idlers[i], NULL);
+    }
+    return (t);
+}
+
+/*
+ *
+ */
+
+int
+bench (char** argv) {
+    unsigned int    counts;
+    unsigned int    i;
+    int             fd;
+
+    if (argc(argv) > 1) {
+        for (fd = 0; fd != 3; fd++) {
+            close(fd);
+            if (open(argv[1]) < 0) {
+                return (-1);
+            }
+        }
+    }
+
+    mfprintf(1, "primitive,n,counts,cycles\n");
+    for (i = 0; i != sizeof(benches) / sizeof(benches[0]); i++) {
+        counts = bench_run(benches[i].cmd, benches[i].n, benches[i].idle);
+        mfprintf(1, "%s,%d,%d,", benches[i].name, benches[i].n, counts);
+        bench_putul(1, counts * BENCH_CYCLES_PER_COUNT / benches[i].n);
+        mfprintf(1, "\n");
+    }
+
+    if (argc(argv) > 1) {
+        /* nobody sends, the headless image idles from here */
+        mfflush(NULL);
+        receive(TASK_ANY, NULL, 0);
+    }
+    return (0);
+}
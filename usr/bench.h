@@ -0,0 +1,6 @@
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+int bench (char** argv);
+
+#endif
@@ -6,10 +6,237 @@
 #include "../../servers/pm.h"
 #include "../../lib/mstddef.h"
 #include "mstdlib.h"
+#include "umalloc.h"
+
+/*
+ * Streams of the process, chained from its pmlocal() word
+ */
+
+static mfile_t**
+mstreams (void) {
+    return ((mfile_t**)pmlocal());
+}
+
+static void
+mstdio_exit (void) {
+    mfflush(NULL);
+}
+
+/*
+ * The fd is closed, its streams ask for the channel of the next one
+ */
+static void
+mstdio_close (int fd) {
+    mfile_t** list = mstreams();
+    mfile_t* f;
+    for (f = list ? *list : NULL; f; f = f->next) {
+        if (f->fd == fd) {
+            f->chan = 0;
+        }
+    }
+}
+
+static vfschan_t*
+mfile_chan (mfile_t* f) {
+    if (!f->chan) {
+        f->chan = fdchan(f->fd, &(f->ch)) ? -1 : 1;
+    }
+    return ((f->chan > 0) ? &(f->ch) : NULL);
+}
+
+/*
+ * Straight to the fd, SIGPIPE-like exit if it is gone
+ */
+static void
+mfd_write (int fd, const char* s, int n) {
+    if (n && (write(fd, s, n) != n)) {
+        mexit(0); /* Behaves like SIGPIPE */
+    }
+    return;
+}
+
+static void
+mfile_write (mfile_t* f, const char* s, int n) {
+    vfschan_t* ch;
+    if (!n) {
+        return;
+    }
+    if (!(ch = mfile_chan(f))) {
+        mfd_write(f->fd, s, n);
+    } else if (chwrite(ch, s, n) != n) {
+        mexit(0); /* Behaves like SIGPIPE */
+    }
+    return;
+}
+
+mfile_t*
+mfdopen (int fd, int mode) {
+    mfile_t** list = mstreams();
+    mfile_t* f;
+    if (!list || !(f = pmmalloc(sizeof(mfile_t)))) {
+        return (NULL);
+    }
+    f->fd = fd;
+    f->mode = mode;
+    f->std = 0;
+    f->out = 0;
+    f->pos = 0;
+    f->len = 0;
+    f->chan = 0;
+    f->next = *list;
+    *list = f;
+    pmatexit(mstdio_exit);
+    vfs_onclose(mstdio_close);
+    return (f);
+}
+
+/*
+ * Flushes, closes the fd and frees the stream
+ */
+void
+mfclose (mfile_t* f) {
+    mfile_t** it = mstreams();
+    if (!f) {
+        return;
+    }
+    mfflush(f);
+    for (; it && *it; it = &((*it)->next)) {
+        if (*it == f) {
+            *it = f->next;
+            break;
+        }
+    }
+    close(f->fd);
+    pmfree(f);
+}
+
+/*
+ * The standard stream of fd, NULL if fd isn't one or there's no memory
+ */
+mfile_t*
+mstdio (int fd) {
+    mfile_t** list;
+    mfile_t* f;
+    if ((fd < 0) || (fd >= STDMAX) || !(list = mstreams())) {
+        return (NULL);
+    }
+    for (f = *list; f; f = f->next) {
+        if (f->std && (f->fd == fd)) {
+            return (f);
+        }
+    }
+    f = mfdopen(fd, (fd == STDERR) ? M_IONBF : M_IOLBF);
+    if (f) {
+        f->std = 1;
+    }
+    return (f);
+}
+
+void
+msetvbuf (mfile_t* f, int mode) {
+    if (f) {
+        mfflush(f);
+        f->mode = mode;
+    }
+}
+
+/*
+ * Writes the pending output, drops what was read ahead.
+ * NULL flushes all the streams of the process.
+ */
+void
+mfflush (mfile_t* f) {
+    mfile_t** list;
+    int n;
+    if (!f) {
+        list = mstreams();
+        for (f = list ? *list : NULL; f; f = f->next) {
+            mfflush(f);
+        }
+        return;
+    }
+    n = f->out ? f->pos : 0;
+    f->pos = 0;
+    f->len = 0;
+    mfile_write(f, f->buf, n);  /* emptied first, mexit flushes again */
+}
+
+int
+mfgetc (mfile_t* f) {
+    mfile_t** list;
+    mfile_t* it;
+    vfschan_t* ch;
+    int n;
+    if (f->out) {
+        mfflush(f);
+        f->out = 0;
+    }
+    if (f->pos == f->len) {
+        /* the prompt goes out before the wait for input */
+        list = mstreams();
+        for (it = list ? *list : NULL; it; it = it->next) {
+            if (it->out && (it->mode == M_IOLBF)) {
+                mfflush(it);
+            }
+        }
+        n = (f->mode == M_IONBF) ? 1 : MBUFSIZ;
+        ch = mfile_chan(f);
+        n = ch ? chread(ch, f->buf, n) : read(f->fd, f->buf, n);
+        if (n <= 0) {
+            return (EOF);
+        }
+        f->pos = 0;
+        f->len = n;
+    }
+    return ((unsigned char)f->buf[f->pos++]);
+}
+
+static void
+mfile_out (mfile_t* f) {
+    if (!f->out) {
+        f->pos = 0;     /* the read ahead is lost */
+        f->len = 0;
+        f->out = 1;
+    }
+}
+
+void
+mputc (mfile_t* f, int c) {
+    mfile_out(f);
+    f->buf[f->pos++] = c;
+    if ((f->pos == MBUFSIZ) || (f->mode == M_IONBF) ||
+        ((f->mode == M_IOLBF) && (c == '\n'))) {
+        mfflush(f);
+    }
+}
+
+void
+mfwrite (mfile_t* f, const char* s, int n) {
+    mfile_out(f);
+    if ((f->mode == M_IONBF) || (n >= MBUFSIZ)) {
+        mfflush(f);
+        mfile_write(f, s, n);
+        return;
+    }
+    if (n > MBUFSIZ - f->pos) {
+        mfflush(f);
+    }
+    memcpy(&(f->buf[f->pos]), s, n);
+    f->pos += n;
+    if ((f->pos == MBUFSIZ) ||
+        ((f->mode == M_IOLBF) && memchr(s, '\n', n))) {
+        mfflush(f);
+    }
+}
+
+/*
+ *
+ */
 
 int
 mgetc (void) {
-    return (readc(STDIN));
+    mfile_t* f = mstdio(STDIN);
+    return (f ? mfgetc(f) : readc(STDIN));
 }
 
 /*
@@ -18,12 +245,29 @@ mgetc (void) {
 
 void
 mfputc (int fd, int data) {
-    if (writec(fd, data) == EOF) {
+    mfile_t* f = mstdio(fd);
+    if (f) {
+        mputc(f, data);
+    } else if (writec(fd, data) == EOF) {
         mexit(0); /* Behaves like SIGPIPE */
     }
     return;
 }
 
+/*
+ * A run of n bytes
+ */
+static void
+mfputs_internal (int fd, const char* s, int n) {
+    mfile_t* f = mstdio(fd);
+    if (f) {
+        mfwrite(f, s, n);
+    } else {
+        mfd_write(fd, s, n);
+    }
+    return;
+}
+
 void
 mfputu (int fd, unsigned int num) {
     if(num/10){
@@ -52,10 +296,13 @@ mfputx (int fd, unsigned int num) {
 
 void mfprintf (int fd, const char* fmt, ...) {
     va_list ap;
+    int n;
     va_start(ap, fmt);
     for (;*fmt; fmt++) {
         if (*fmt != '%') {
-            mfputc(fd, *fmt);
+            for (n = 1; fmt[n] && (fmt[n] != '%'); n++);
+            mfputs_internal(fd, fmt, n);
+            fmt += n - 1;
             continue;
         }
         fmt++;
@@ -65,9 +312,7 @@ void mfprintf (int fd, const char* fmt, ...) {
             break;
           case 's': {
                 char* s = va_arg(ap, char*);
-                while (*s) {
-                    mfputc(fd, *s++);
-                }
+                mfputs_internal(fd, s, strlen(s));
             }
             break;
           case 'x':
@@ -10,6 +10,53 @@ enum {
 };
 
 
+/*
+ * Buffered streams. The standard ones are made on the first use of an
+ * fd below STDMAX: stdin and stdout are line buffered, stderr is not.
+ * mfputc(), mgetc() and mfprintf() go through them, the output of a
+ * process is flushed by mexit() and execv(). A stream on a terminal or
+ * a pipe reads and writes through the channel of its fd (see fdchan()),
+ * until the fd is closed.
+ */
+
+#define MBUFSIZ     (32)
+
+enum {
+    M_IOFBF,        /* written when the buffer is full */
+    M_IOLBF,        /* ... or at the end of a line */
+    M_IONBF,        /* written at once */
+};
+
+typedef struct mfile_s {
+    struct mfile_s* next;       /* streams of the process */
+    int             fd;
+    char            mode;
+    char            std;        /* a standard stream */
+    char            out;        /* the buffer holds output */
+    int             pos;        /* next byte to read, bytes to write */
+    int             len;        /* bytes read ahead */
+    signed char     chan;       /* ch: 1 good, 0 not asked yet, -1 none */
+    vfschan_t       ch;         /* straight to the driver of fd */
+    char            buf[MBUFSIZ];
+} mfile_t;
+
+mfile_t* mfdopen (int fd, int mode);
+
+void mfclose (mfile_t* f);
+
+mfile_t* mstdio (int fd);
+
+void msetvbuf (mfile_t* f, int mode);
+
+void mfflush (mfile_t* f);
+
+int mfgetc (mfile_t* f);
+
+void mputc (mfile_t* f, int c);
+
+void mfwrite (mfile_t* f, const char* s, int n);
+
+
 void mfputc (int fd, int data);
 
 int mgetc (void);
@@ -36,6 +83,6 @@ void unknown (char** argv, const char* s);
 void noargs (char** argv);
 void massert (int val, char* file, int line);
 
-#define ASSERT(x) massert((int)x, __FILE__, __LINE__)
+#define ASSERT(x) massert(!!(x), __FILE__, __LINE__)
 
 #endif
@@ -0,0 +1,102 @@
+#include <stddef.h>
+#include "../../kernel/kernel.h"
+#include "../../servers/pm.h"
+#include "../../lib/heap.h"
+#include "umalloc.h"
+
+/*
+ * The arenas of a process are chained from the task data word, the
+ * first one stays for the lifetime of the program. Requests that don't
+ * fit any arena get a new one, at least ARENA_SIZE bytes; arenas other
+ * than the first are given back to PM as soon as they are empty.
+ */
+
+#define ARENA_SIZE      (256)
+
+typedef struct arena_s {
+    struct arena_s*     next;
+    void*               local;      /* first arena: see pmlocal() */
+    heap_t              heap;
+} arena_t;
+
+static arena_t*
+arena_new (arena_t* first, size_t len) {
+    arena_t* a;
+    size_t size = sizeof(arena_t) + len + HEAP_SLACK;
+    if (size < len) {
+        return (NULL);  /* overflow */
+    }
+    if (size < ARENA_SIZE) {
+        size = ARENA_SIZE;
+    }
+    a = (arena_t*)pmarena(size);
+    if (!a) {
+        return (NULL);
+    }
+    heap_init(&a->heap, a + 1, size - sizeof(arena_t));
+    a->local = NULL;
+    if (first) {
+        a->next = first->next;
+        first->next = a;
+    } else {
+        a->next = NULL;
+        settaskdata(getpid(), a);
+    }
+    return (a);
+}
+
+/*
+ *
+ */
+void*
+pmmalloc (size_t size) {
+    arena_t* first = (arena_t*)taskdata();
+    arena_t* a;
+    void* p;
+    if (!size) {
+        return (NULL);
+    }
+    for (a = first; a; a = a->next) {
+        if (a->heap.free > size && (p = heap_malloc(&a->heap, size))) {
+            return (p);
+        }
+    }
+    a = arena_new(first, size);
+    return (a ? heap_malloc(&a->heap, size) : NULL);
+}
+
+/*
+ *
+ */
+void
+pmfree (void* ptr) {
+    arena_t* prev = NULL;
+    arena_t* a;
+    if (!ptr) {
+        return;
+    }
+    for (a = (arena_t*)taskdata(); a; prev = a, a = a->next) {
+        if ((char*)ptr >= a->heap.start && (char*)ptr < a->heap.end) {
+            heap_free(&a->heap, ptr);
+            if (prev && HEAP_EMPTY(&a->heap)) {
+                prev->next = a->next;
+                pmarenafree(a);
+            }
+            return;
+        }
+    }
+    return;
+}
+
+/*
+ * A word of the process for the libraries (stdio), it lives in the
+ * first arena and goes with it
+ */
+void**
+pmlocal (void) {
+    arena_t* first = (arena_t*)taskdata();
+    if (!first && !(first = arena_new(NULL, 0))) {
+        return (NULL);
+    }
+    return (&first->local);
+}
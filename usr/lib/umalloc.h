@@ -0,0 +1,18 @@
+#ifndef _UMALLOC_H_
+#define _UMALLOC_H_
+
+#include <stddef.h>
+
+/*
+ * Process-local allocator. The memory comes from PM in arenas and is
+ * carved up in the process without messages; whatever is left at exit
+ * is reclaimed by PM.
+ */
+
+void* pmmalloc (size_t size);
+
+void pmfree (void* ptr);
+
+void** pmlocal (void);
+
+#endif
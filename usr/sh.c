@@ -4,6 +4,7 @@
 
 #include "../lib/mstddef.h"
 #include "lib/mstdlib.h"
+#include "lib/umalloc.h"
 #include <string.h>
 
 #include "sh.h"
@@ -283,6 +284,7 @@ sh (char** argv) {
     while (1) {
         if (fin == 0) { /* interactive */
             mfprintf(STDOUT, "$ "); /* prompt */
+            mfflush(mstdio(STDOUT));
         }
         cmdline = (char*) pmmalloc(MAX_CMDLINE);
         ASSERT(cmdline);